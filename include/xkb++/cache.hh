@@ -0,0 +1,128 @@
+#ifndef CACHE_HH
+#define CACHE_HH
+
+#include <base/Base.hh>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <xkb++/compose.hh>
+#include <xkb++/kb.hh>
+
+namespace kb {
+using namespace base;
+
+/// Bump this whenever the format of xkbgen’s cache entries changes; changes
+/// to the output of ParsedLayout::emit() are detected by EmitterHash().
+constexpr u32 CACHE_FORMAT_VERSION = 2;
+
+/// Bump this whenever the layout of a ComposeTable changes.
+constexpr u32 COMPOSE_CACHE_VERSION = 1;
+
+// ============================================================================
+//  Helpers
+// ============================================================================
+/// Append a value to a cache entry; entries are in native byte order since
+/// a cache is never shared between machines.
+template <typename T>
+void Append(std::string& out, T value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof value);
+}
+
+/// Read a value written by Append().
+template <typename T>
+auto Read(std::string_view& in, T& value) -> bool {
+    if (in.size() < sizeof value) return false;
+    std::memcpy(&value, in.data(), sizeof value);
+    in.remove_prefix(sizeof value);
+    return true;
+}
+
+/// Write a file to a temporary file and rename it into place, so readers
+/// never see a partially written file.
+auto WriteAtomically(const std::filesystem::path& path, std::string_view data) -> Result<>;
+
+/// Get a hash of what ParsedLayout::emit() produces for a fixed layout that
+/// uses every kind of symbol, so cached outputs of a different emitter are
+/// never reused even if nobody remembered to bump CACHE_FORMAT_VERSION.
+auto EmitterHash() -> u64;
+
+// ============================================================================
+//  Caches
+// ============================================================================
+/// On-disk cache for xkbgen.
+///
+/// Complete outputs are stored under a hash of everything they depend
+/// on, so an unchanged input never has to be parsed again. In addition,
+/// the emitted line of every record is kept per output file, so that
+/// after an edit only the records that actually changed are emitted.
+///
+/// Entries are written to a temporary file and renamed into place, so
+/// several processes may share a cache directory.
+class BuildCache {
+    std::filesystem::path outputs_dir;
+    std::filesystem::path records_dir;
+    u64 emitter_hash{};
+
+    BuildCache() = default;
+
+public:
+    /// Emitted lines of records, by record hash.
+    using Fragments = std::unordered_map<u64, std::string>;
+
+    /// Open a cache directory, creating it if it doesn’t exist.
+    static auto Create(const std::filesystem::path& dir) -> Result<std::unique_ptr<BuildCache>>;
+
+    /// Get the EmitterHash() of this build; keys of outputs must include it.
+    auto emitter() const -> u64 { return emitter_hash; }
+
+    /// Get the cached output for a key.
+    auto Load(u64 key) const -> std::optional<MappedFile>;
+
+    /// Get the record fragments last emitted for an output file.
+    auto LoadFragments(std::string_view output) const -> Fragments;
+
+    /// Store the output for a key.
+    auto Store(u64 key, std::string_view data) const -> Result<>;
+
+    /// Replace the record fragments of an output file.
+    auto StoreFragments(std::string_view output, const Fragments& fragments) const -> Result<>;
+};
+
+/// On-disk cache of compose tables.
+///
+/// Tables are stored in a form that is mapped and used in place, so
+/// loading one doesn’t parse anything. Each entry records the modification
+/// time, size, and hash of every file that the table was loaded from; an
+/// entry is used only if those files are unchanged, and a file whose
+/// modification time has changed is hashed again before the entry is
+/// discarded.
+class ComposeCache {
+    std::filesystem::path dir;
+
+    ComposeCache() = default;
+
+public:
+    /// Open a cache directory, creating it if it doesn’t exist.
+    static auto Create(const std::filesystem::path& dir) -> Result<std::unique_ptr<ComposeCache>>;
+
+    /// Get the table for a compose file, from the cache if it is up to
+    /// date; otherwise, load the file and store the table.
+    auto Get(std::string_view path) const -> Result<ComposeTable>;
+
+    /// Get the cached table for a compose file, if it is up to date.
+    auto Load(std::string_view path) const -> std::optional<ComposeTable>;
+
+    /// Store the table for a compose file.
+    auto Store(std::string_view path, const ComposeTable& table) const -> Result<>;
+};
+
+/// Get the directory in which our caches live by default:
+/// $XDG_CACHE_HOME/xkb++, or ~/.cache/xkb++.
+auto DefaultCacheDir() -> Result<std::filesystem::path>;
+} // namespace kb
+
+#endif // CACHE_HH
@@ -0,0 +1,210 @@
+#ifndef COMPOSE_HH
+#define COMPOSE_HH
+
+#include <base/Base.hh>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <xkb++/kb.hh>
+#include <xkbcommon/xkbcommon.h>
+
+namespace kb {
+using namespace base;
+
+/// What a compose sequence produces.
+struct ComposeResult {
+    /// The text; may be empty if there is only a keysym.
+    std::string_view text;
+
+    /// The keysym, or NoSymbol if there is only text.
+    xkb_keysym_t keysym = XKB_KEY_NoSymbol;
+};
+
+/// A line in a compose file.
+struct ComposeLocation {
+    /// Index into ComposeTable::files().
+    u32 file{};
+    u32 line{};
+};
+
+/// A problem found while loading a compose file.
+struct ComposeDiagnostic {
+    enum class Kind : u8 {
+        /// The line can’t be parsed, or an include failed.
+        Syntax,
+
+        /// A keysym name that doesn’t exist.
+        UnknownKeysym,
+
+        /// A sequence that was already defined with the same result.
+        Duplicate,
+
+        /// A sequence that was already defined with a different result;
+        /// the later definition wins.
+        Override,
+
+        /// A sequence that is a prefix of another one or vice versa; the
+        /// longer one wins.
+        PrefixConflict,
+    };
+
+    Kind kind;
+    ComposeLocation location;
+    std::string message;
+
+    /// Where the sequence this conflicts with was defined, if any.
+    std::optional<ComposeLocation> previous;
+};
+
+/// A file that a compose table was loaded from.
+struct ComposeFile {
+    std::string path;
+
+    /// The modification time and size of the file when it was read, and
+    /// a hash of its contents, so caches can tell whether it has changed.
+    i64 mtime{};
+    u64 size{};
+    u64 hash{};
+
+    /// Whether this was read because of an include.
+    bool included = false;
+};
+
+/// Compose sequences, as loaded from an .XCompose file.
+///
+/// Sequences are stored as a trie in a single array; the children of each
+/// node are contiguous and sorted by keysym, so looking up a key is a
+/// binary search over its siblings. The root is node 0.
+///
+/// The arrays contain no pointers, so a table can also be used in place
+/// from a mapped cache file; see ComposeCache.
+class ComposeTable {
+public:
+    using NodeIndex = u32;
+    static constexpr NodeIndex Root = 0;
+    static constexpr u32 NoResult = ~0u;
+
+    struct Node {
+        xkb_keysym_t keysym;
+        u32 first_child;
+        u32 child_count;
+
+        /// Index into the results, or NoResult if this isn’t the end of
+        /// a sequence.
+        u32 result;
+    };
+
+    /// A result as stored; the text is a range of the string table.
+    struct StoredResult {
+        u32 text_offset;
+        u32 text_size;
+        xkb_keysym_t keysym;
+    };
+
+private:
+    friend class ComposeCache;
+    friend class ComposeParser;
+
+    /// The arrays are owned either by the vectors below or by the mapping
+    /// of a cache file; moving a table leaves both valid.
+    std::optional<MappedFile> mapping;
+    std::span<const Node> trie;
+    std::span<const StoredResult> results;
+    std::string_view strings;
+    std::vector<Node> trie_storage;
+    std::vector<StoredResult> result_storage;
+    std::vector<char> string_storage;
+
+    std::vector<ComposeFile> file_list;
+    std::vector<ComposeLocation> result_locations;
+    std::vector<ComposeDiagnostic> diagnostic_list;
+    usz sequence_count{};
+
+    ComposeTable() = default;
+
+public:
+    ComposeTable(const ComposeTable&) = delete;
+    ComposeTable& operator=(const ComposeTable&) = delete;
+    ComposeTable(ComposeTable&&) = default;
+    ComposeTable& operator=(ComposeTable&&) = default;
+
+    /// Get the children of a node.
+    auto children(NodeIndex node) const -> std::span<const Node> {
+        return trie.subspan(trie[node].first_child, trie[node].child_count);
+    }
+
+    /// Get all problems found while loading the table; tables from a
+    /// cache have none.
+    auto diagnostics() const -> std::span<const ComposeDiagnostic> { return diagnostic_list; }
+
+    /// Get all files that were read; the first one is the file that was
+    /// loaded, and the rest are includes.
+    auto files() const -> std::span<const ComposeFile> { return file_list; }
+
+    /// Find the child of a node for a keysym.
+    auto find(NodeIndex node, xkb_keysym_t keysym) const -> std::optional<NodeIndex>;
+
+    /// Call 'fn(suffix, result)' for every sequence that continues past a
+    /// node, in keysym order; 'suffix' is the part after the node.
+    template <typename Callable>
+    void for_each_sequence(NodeIndex node, Callable fn) const {
+        std::vector<xkb_keysym_t> suffix;
+        Walk(node, suffix, fn);
+    }
+
+    /// Check whether a file was read because of an include.
+    auto included(u32 file) const -> bool { return file_list[file].included; }
+
+    /// Find the node for a sequence; this may be a prefix of longer sequences.
+    auto lookup(std::span<const xkb_keysym_t> sequence) const -> std::optional<NodeIndex>;
+
+    /// Get a node.
+    auto node(NodeIndex index) const -> const Node& { return trie[index]; }
+
+    /// Get the result of a node, if it ends a sequence.
+    auto result(NodeIndex index) const -> std::optional<ComposeResult> {
+        auto r = trie[index].result;
+        if (r == NoResult) return std::nullopt;
+        return ComposeResult{.text = strings.substr(results[r].text_offset, results[r].text_size), .keysym = results[r].keysym};
+    }
+
+    /// Get the location at which the result of a node was defined; this
+    /// is not available for tables from a cache.
+    auto result_location(NodeIndex index) const -> ComposeLocation { return result_locations[trie[index].result]; }
+
+    /// Get the number of sequences.
+    auto size() const -> usz { return sequence_count; }
+
+    /// Load a compose file and everything it includes. Problems with
+    /// individual lines are collected as diagnostics; only failing to read
+    /// the file itself is an error.
+    static auto Load(std::string_view path) -> Result<ComposeTable>;
+
+private:
+    template <typename Callable>
+    void Walk(NodeIndex node, std::vector<xkb_keysym_t>& suffix, Callable& fn) const {
+        auto first = trie[node].first_child;
+        for (auto [i, child] : children(node) | vws::enumerate) {
+            auto index = NodeIndex(first + usz(i));
+            suffix.push_back(child.keysym);
+            if (auto r = result(index)) fn(std::span<const xkb_keysym_t>{suffix}, *r);
+            Walk(index, suffix, fn);
+            suffix.pop_back();
+        }
+    }
+};
+
+/// Find the compose file that applications use: $XCOMPOSEFILE, then
+/// ~/.XCompose, then that of the current locale.
+auto DefaultComposeFile() -> Result<std::string>;
+
+/// Find the compose file of the current locale, as used for 'include "%L"'.
+auto LocaleComposeFile() -> Result<std::string>;
+
+/// Format a sequence of keysyms as '<a> <b> ...'.
+auto FormatComposeSequence(std::span<const xkb_keysym_t> sequence) -> std::string;
+} // namespace kb
+
+#endif // COMPOSE_HH
@@ -0,0 +1,178 @@
+#ifndef KB_HH
+#define KB_HH
+
+#include <base/Base.hh>
+#include <memory>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include <xkbcommon/xkbcommon.h>
+
+namespace kb {
+using namespace base;
+
+constexpr usz LAYER_COUNT = 8;
+
+/// Maximum number of groups a record can have.
+constexpr usz MAX_GROUPS = 4;
+
+// ============================================================================
+//  Files
+// ============================================================================
+/// A read-only memory mapping of a file.
+class MappedFile {
+    std::string_view data;
+
+    explicit MappedFile(std::string_view data) : data{data} {}
+
+public:
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    MappedFile(MappedFile&& other) noexcept : data{std::exchange(other.data, {})} {}
+    MappedFile& operator=(MappedFile&& other) noexcept;
+    ~MappedFile();
+
+    /// Map a file into memory.
+    static auto Open(std::string_view path) -> Result<MappedFile>;
+
+    /// Get the contents of the file.
+    auto contents() const -> std::string_view { return data; }
+};
+
+// ============================================================================
+//  Layout Definition
+// ============================================================================
+/// A symbol on some level of a key.
+struct Symbol {
+    /// The symbol as written in the source, without quotes.
+    std::string_view text;
+
+    /// The character, if the symbol is a single one; 0 if it is a
+    /// keysym name or empty.
+    char32_t codepoint{};
+};
+
+/// Bump allocator for strings that live as long as the arena.
+class StringArena {
+    static constexpr usz ChunkSize = 16 * 1024;
+
+    std::vector<std::unique_ptr<char[]>> chunks;
+    char* ptr{};
+    usz remaining{};
+
+public:
+    StringArena() = default;
+    StringArena(const StringArena&) = delete;
+    StringArena& operator=(const StringArena&) = delete;
+    StringArena(StringArena&&) noexcept = default;
+    StringArena& operator=(StringArena&&) noexcept = default;
+
+    /// Copy a string into the arena.
+    auto save(std::string_view s) -> std::string_view;
+};
+
+class Parser;
+
+/// A parsed .kb file.
+///
+/// Records are stored as a struct of arrays: the groups of record 'r' are
+/// 'record_groups[r]' up to 'record_groups[r + 1]', and the symbols of group
+/// 'g' are 'group_symbols[g]' up to 'group_symbols[g + 1]'. Symbols are
+/// interned; each slot is an index into 'pool', in which index 0 is the empty
+/// symbol, and their keysym names are looked up once while parsing. All text
+/// is owned by the layout, so the source may be discarded after parsing.
+class ParsedLayout {
+    friend class Parser;
+
+    StringArena arena;
+    std::vector<Symbol> pool;
+    std::vector<std::string_view> keysym_names;
+    std::vector<std::string_view> names;
+    std::vector<u32> offsets;
+    std::vector<u32> record_groups{0};
+    std::vector<u32> group_symbols{0};
+    std::vector<u32> slots;
+    usz max_groups = 1;
+
+public:
+    /// Append the symbols file for this layout to a string.
+    void emit(std::string& out, std::string_view name) const;
+
+    /// Append the parts of the symbols file that come before and after
+    /// the records; emit() is these with every record in between.
+    void emit_header(std::string& out, std::string_view name) const;
+    void emit_footer(std::string& out) const;
+
+    /// Append the line for a single record.
+    void emit_record(std::string& out, usz index) const;
+
+    /// Get the number of groups of a record.
+    auto group_count(usz index) const -> usz { return record_groups[index + 1] - record_groups[index]; }
+
+    /// Get the highest number of groups of any record.
+    auto groups() const -> usz { return max_groups; }
+
+    /// Get a hash of the contents of a record; records with the same hash
+    /// produce the same output.
+    auto record_hash(usz index) const -> u64;
+
+    /// Get the key name of a record.
+    auto record_name(usz index) const -> std::string_view { return names[index]; }
+
+    /// Get the offset of the start of a record in the source.
+    auto record_offset(usz index) const -> usz { return offsets[index]; }
+
+    /// Get the symbols of a group of a record, as indices for symbol().
+    auto record_symbols(usz index, usz group = 0) const -> std::span<const u32> {
+        auto g = record_groups[index] + group;
+        return std::span{slots}.subspan(group_symbols[g], group_symbols[g + 1] - group_symbols[g]);
+    }
+
+    /// Get the number of records.
+    auto size() const -> usz { return names.size(); }
+
+    /// Get the XKB name of an interned symbol.
+    auto keysym_name(u32 id) const -> std::string_view { return keysym_names[id]; }
+
+    /// Get an interned symbol.
+    auto symbol(u32 id) const -> const Symbol& { return pool[id]; }
+
+    /// Get the number of distinct symbols.
+    auto symbol_count() const -> usz { return pool.size(); }
+
+    /// Parse a keyboard layout from a string; errors are reported as
+    /// 'filename:line:column'.
+    static auto Parse(std::string_view text, std::string_view filename = "<input>") -> Result<ParsedLayout>;
+};
+
+// ============================================================================
+//  Helpers
+// ============================================================================
+/// 64-bit FNV-1a hash; pass a previous hash as the seed to combine hashes.
+auto Hash(std::string_view data, u64 seed = 0xCBF2'9CE4'8422'2325) -> u64;
+
+/// Format an offset into a source file as 'filename:line:column'; columns
+/// are counted in characters, not bytes.
+auto FormatLocation(std::string_view filename, std::string_view text, usz offset) -> std::string;
+
+/// Get the XKB name of a symbol.
+auto KeySymName(const Symbol& sym) -> std::string_view;
+
+/// Compile a layout into a complete keymap, using the system’s XKB data
+/// for everything other than the symbols.
+auto CompileKeymap(xkb_context* ctx, const ParsedLayout& layout, std::string_view name) -> Result<xkb_keymap*>;
+
+/// Wrap the symbols of a layout in a complete keymap.
+///
+/// If 'first_record_line' is not null, it is set to the (1-based) line of
+/// the first record in the keymap; every record takes up one line.
+auto KeymapSource(
+    const ParsedLayout& layout,
+    std::string_view name,
+    usz* first_record_line = nullptr
+) -> std::string;
+} // namespace kb
+
+#endif // KB_HH
@@ -0,0 +1,62 @@
+#ifndef KEYMAP_HH
+#define KEYMAP_HH
+
+#include <array>
+#include <base/Base.hh>
+#include <span>
+#include <string>
+#include <X11/X.h>
+#include <xkbcommon/xkbcommon.h>
+
+namespace xkb {
+using namespace base;
+
+/// Number of levels that we display for each key.
+constexpr usz LEVEL_COUNT = 8;
+
+/// A keysym on some level of a key.
+struct Symbol {
+    /// The keysym itself.
+    xkb_keysym_t keysym = XKB_KEY_NoSymbol;
+
+    /// The character it produces; for dead keys, this is the corresponding
+    /// combining character, if there is one.
+    char32_t codepoint{};
+
+    /// Whether this is a dead key.
+    bool dead = false;
+};
+
+/// The symbols on all levels of a key.
+using KeyLevels = std::array<Symbol, LEVEL_COUNT>;
+
+/// Check if a keysym is a dead key.
+[[nodiscard]] constexpr bool IsDeadKeysym(xkb_keysym_t sym) {
+    return (sym >= 0xFE50 and sym <= 0xFE6F) or // dead_grave ... dead_currency
+           (sym >= 0xFE80 and sym <= 0xFE8F) or // dead_a ... dead_hamza
+           (sym >= 0xFE90 and sym <= 0xFE93);   // dead_lowline ... dead_longsolidusoverlay
+}
+
+/// Get the text to display for a symbol; diacritics are drawn on
+/// a dotted circle.
+[[nodiscard]] auto DisplayText(const Symbol& sym) -> std::u32string;
+
+/// Check if a symbol is displayed as a diacritic.
+[[nodiscard]] bool IsDiacritic(const Symbol& sym);
+
+/// Get the character that a keysym produces, or 0 if there is none.
+[[nodiscard]] auto KeysymToUTF32(xkb_keysym_t sym) -> char32_t;
+
+/// Resolve the keysyms on all levels of a set of keys.
+///
+/// The levels are those of the EIGHT_LEVEL key type, i.e. the
+/// combinations of Shift, Mod5 (level 3), and Mod3 (level 5).
+void ResolveLevels(
+    xkb_keymap* keymap,
+    xkb_layout_index_t group,
+    std::span<const KeyCode> keycodes,
+    std::span<KeyLevels> out
+);
+} // namespace xkb
+
+#endif // KEYMAP_HH
@@ -7,6 +7,7 @@
 #include <numeric>
 #include <span>
 #include <X11/X.h>
+#include <X11/Xlib.h>
 
 /// Libclopts unfortunately only accepts string literals in values<> options...
 #define LAYOUT_NAME_ISO105 "iso-105"
@@ -14,6 +15,108 @@
 
 namespace layout {
 using namespace base;
+
+/// Size of the keyboard at which everything has its nominal size; when
+/// the keyboard is resized, everything is scaled relative to the width.
+constexpr u32 BASE_WIDTH = 1'400;
+constexpr u32 BASE_HEIGHT = 550;
+constexpr u32 BASE_LINE_WIDTH = 2;
+
+/// Colours used for drawing the keyboard.
+constexpr u32 BACKGROUND_COLOUR = 0x2D'2A2E;
+constexpr u32 FOREGROUND_COLOUR = 0xFC'FCFA;
+constexpr u32 GREY_COLOUR = 0x5B'595C;
+constexpr u32 RED_COLOUR = 0xFF'6188;
+constexpr u32 HIGHLIGHT_COLOUR = 0xFF'D866;
+constexpr u32 PRESSED_COLOUR = 0x40'3E41;
+
+struct Point {
+    int x{};
+    int y{};
+};
+
+/// Where a key and the symbols on it are drawn.
+struct KeyGeometry {
+    XRectangle border{};
+    std::array<Point, 8> keysyms{};
+};
+
+/// Resolution-independent geometry of a key, in units of the keyboard
+/// width; a key at some width is these values scaled by the width.
+struct NormalisedKey {
+    /// x, y, width, height.
+    std::array<float, 4> border{};
+
+    /// x and y of the anchor of each level.
+    std::array<float, 16> keysyms{};
+};
+
+namespace detail {
+/// Proportions of a standard (1u) key and the gaps around it.
+constexpr float CellSize = .0625f;
+constexpr float CellGap = .0125f;
+constexpr float TopOffset = .05f;
+
+/// All keys 1u wide.
+template <usz N>
+consteval auto UniformWidths() -> std::array<float, N> {
+    std::array<float, N> widths{};
+    widths.fill(1);
+    return widths;
+}
+
+/// Lay out rows of keys; 'widths' are in units of a standard key, and
+/// each row is indented by a further two gaps.
+template <usz N>
+consteval auto MakeGeometry(
+    const std::array<usz, 4>& rows,
+    const std::array<float, N>& widths = UniformWidths<N>()
+) -> std::array<NormalisedKey, N> {
+    std::array<NormalisedKey, N> keys{};
+    usz index = 0;
+    for (usz row = 0; row < rows.size(); row++) {
+        auto x = CellGap + float(row) * 2 * CellGap;
+        auto y = float(row + 1) * CellGap + float(row) * CellSize + TopOffset;
+        for (usz i = 0; i < rows[row]; i++, index++) {
+            auto w = CellSize * widths[index] + CellGap * (widths[index] - 1);
+            auto& key = keys[index];
+            key.border = {x, y, w, CellSize};
+
+            // Symbols are arranged in columns of two, bottom to top, starting
+            // from the left of the key; this uses the height rather than the
+            // width so wide keys don’t spread them out.
+            auto bottom = y + CellSize - .25f * CellSize;
+            auto top = y + .25f * CellSize;
+            for (usz level = 0; level < 8; level++) {
+                key.keysyms[2 * level] = x + .1f * CellSize + .23f * CellSize * float(level / 2);
+                key.keysyms[2 * level + 1] = level % 2 == 0 ? bottom : top;
+            }
+
+            x += w + CellGap;
+        }
+    }
+    return keys;
+}
+
+inline constexpr std::array<usz, 4> ISO105Rows{13, 12, 12, 11};
+inline constexpr std::array<KeyCode, 48> ISO105Codes{ // clang-format off
+    49, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+    24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
+    38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 51,
+    94, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+}; // clang-format on
+inline constexpr auto ISO105Geometry = MakeGeometry<48>(ISO105Rows);
+
+inline constexpr std::array<usz, 4> ANSI104Rows{13, 13, 11, 10};
+inline constexpr std::array<KeyCode, 47> ANSI104Codes{ // clang-format off
+    49, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
+    24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 51,
+    38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
+}; // clang-format on
+inline constexpr auto ANSI104Geometry = MakeGeometry<47>(ANSI104Rows);
+} // namespace detail
+
 struct LayoutDescription {
     /// Name of the keyboard layout.
     std::string_view name;
@@ -25,7 +128,10 @@ struct LayoutDescription {
     std::u32string_view labels;
 
     /// Flat list of all key codes.
-    std::initializer_list<KeyCode> codes;
+    std::span<const KeyCode> codes;
+
+    /// Normalised geometry of each key.
+    std::span<const NormalisedKey> geometry;
 
     /// Get the number of keys that this layout has.
     [[nodiscard]] constexpr auto num_keys() const {
@@ -33,36 +139,69 @@ struct LayoutDescription {
     }
 };
 
-inline constexpr LayoutDescription ISO105 { // clang-format off
+inline constexpr LayoutDescription ISO105 {
     .name = LAYOUT_NAME_ISO105,
-    .rows = {13, 12, 12, 11},
+    .rows = detail::ISO105Rows,
     .labels =
         U"¬1234567890-="
         U"QWERTYUIOP[]"
         U"ASDFGHJKL;'^"
         U"´ZXCVBNM,./",
-    .codes = {
-        49, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
-        24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35,
-        38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48, 51,
-        94, 52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-    },
-}; // clang-format on
+    .codes = detail::ISO105Codes,
+    .geometry = detail::ISO105Geometry,
+};
 
-inline constexpr LayoutDescription ANSI104 { // clang-format off
+inline constexpr LayoutDescription ANSI104 {
     .name = LAYOUT_NAME_ANSI104,
-    .rows = {13, 13, 11, 10},
+    .rows = detail::ANSI104Rows,
     .labels =
         U"¬1234567890-="
         U"QWERTYUIOP[]\\"
         U"ASDFGHJKL;'"
         U"ZXCVBNM,./",
-    .codes = {
-        49, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21,
-        24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 51,
-        38, 39, 40, 41, 42, 43, 44, 45, 46, 47, 48,
-        52, 53, 54, 55, 56, 57, 58, 59, 60, 61,
-    },
-}; // clang-format on
+    .codes = detail::ANSI104Codes,
+    .geometry = detail::ANSI104Geometry,
+};
+
+static_assert(ISO105.labels.size() == ISO105.num_keys() and ISO105.codes.size() == ISO105.num_keys());
+static_assert(ANSI104.labels.size() == ANSI104.num_keys() and ANSI104.codes.size() == ANSI104.num_keys());
+
+/// Get a layout by name.
+constexpr auto FindLayout(std::string_view name) -> const LayoutDescription* {
+    if (name == LAYOUT_NAME_ISO105) return &ISO105;
+    if (name == LAYOUT_NAME_ANSI104) return &ANSI104;
+    return nullptr;
+}
+
+/// Get the font size of the key labels for a given width.
+constexpr auto FontSize(u32 width) -> u32 { return u32(width * .015); }
+
+/// Get the font size of the keycodes.
+constexpr auto KeycodeFontSize(u32 font_size) -> u32 { return font_size / 2; }
+
+/// Get the font size of the keysyms.
+constexpr auto KeysymFontSize(u32 font_size) -> u32 { return u32(font_size / 1.33); }
+
+/// Get the width of the key borders for a given width.
+constexpr auto LineWidth(u32 width) -> u32 {
+    return u32(BASE_LINE_WIDTH * double(width) / double(BASE_WIDTH));
+}
+
+/// Get the position of a key label, given the size of its text.
+constexpr auto LabelPosition(const XRectangle& key, int text_width, int text_height) -> Point {
+    return {
+        .x = key.x + key.width / 2 - text_width / 2,
+        .y = key.y + key.height / 2 + text_height / 2,
+    };
+}
+
+/// Get the position of the keycode of a key.
+constexpr auto KeycodePosition(const XRectangle& key, int label_x, u32 font_size) -> Point {
+    return {.x = label_x, .y = int(key.y) + int(font_size) / 2 + 4};
 }
+
+/// Scale the geometry of a layout to a given width.
+void PlaceKeys(const LayoutDescription& layout, u32 width, std::span<KeyGeometry> keys);
+} // namespace layout
+
 #endif // LAYOUT_HH
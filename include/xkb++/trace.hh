@@ -0,0 +1,88 @@
+#ifndef TRACE_HH
+#define TRACE_HH
+
+#include <base/Base.hh>
+#include <chrono>
+#include <cstdio>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace trace {
+using namespace base;
+using Clock = std::chrono::steady_clock;
+
+/// Timing statistics of a phase.
+struct PhaseStats {
+    std::string_view name;
+    usz count{};
+    std::chrono::nanoseconds p50{};
+    std::chrono::nanoseconds p90{};
+    std::chrono::nanoseconds p99{};
+    std::chrono::nanoseconds max{};
+    std::chrono::nanoseconds total{};
+};
+
+/// Records how long the phases of a program take.
+///
+/// Phases are named by string literals, and recording one is only two
+/// clock reads and a push_back, so timers can stay in place permanently;
+/// if recording is disabled, the timers are still usable to measure a
+/// single duration, but nothing is kept.
+class Tracer {
+    struct Event {
+        std::string_view name;
+        Clock::time_point start;
+        Clock::duration duration;
+    };
+
+    /// Stop recording after this many events so a long session
+    /// can’t use up all of our memory.
+    static constexpr usz MaxEvents = 1 << 20;
+
+    std::vector<Event> events;
+    Clock::time_point epoch = Clock::now();
+    usz dropped{};
+    bool enabled;
+
+public:
+    /// A running timer; the phase ends when this goes out of scope
+    /// or when End() is called, whichever happens first.
+    class Scope {
+        Tracer* tracer;
+        std::string_view name;
+        Clock::time_point start = Clock::now();
+
+    public:
+        Scope(Tracer* tracer, std::string_view name) : tracer{tracer}, name{name} {}
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+        ~Scope() { End(); }
+
+        /// End the phase and get its duration.
+        auto End() -> Clock::duration;
+    };
+
+    explicit Tracer(bool enabled) : enabled{enabled} {
+        if (enabled) events.reserve(4'096);
+    }
+
+    /// Start timing a phase; the name must outlive the tracer.
+    [[nodiscard]] auto Begin(std::string_view name) -> Scope { return {this, name}; }
+
+    /// Get statistics for each phase, in the order in which the
+    /// phases were first recorded.
+    [[nodiscard]] auto Stats() const -> std::vector<PhaseStats>;
+
+    /// Print a table of Stats().
+    void PrintStats(std::FILE* stream) const;
+
+    /// Write all events as a Chrome trace (chrome://tracing, Perfetto).
+    [[nodiscard]] auto WriteChromeTrace(std::string_view path) const -> Result<>;
+
+private:
+    void Record(std::string_view name, Clock::time_point start, Clock::duration duration);
+};
+} // namespace trace
+
+#endif // TRACE_HH
@@ -0,0 +1,31 @@
+#include <base/Base.hh>
+#include <cstdlib>
+#include <new>
+
+using namespace base;
+
+// This replaces the global operator new so xkbdisplay --check-allocations
+// can count allocations; it is only linked into xkbdisplay, never into the
+// xkb++ library, since it would otherwise end up in every executable.
+namespace {
+/// Heap allocations made by this thread; the font matcher thread isn’t
+/// counted, and neither is anything that Xlib and friends allocate with
+/// malloc().
+thread_local u64 allocations = 0;
+} // namespace
+
+auto AllocationCount() -> u64 {
+    return allocations;
+}
+
+void* operator new(usz size) {
+    allocations++;
+    if (auto ptr = std::malloc(size ? size : 1)) return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new[](usz size) { return operator new(size); }
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+void operator delete(void* ptr, usz) noexcept { std::free(ptr); }
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+void operator delete[](void* ptr, usz) noexcept { std::free(ptr); }
@@ -0,0 +1,232 @@
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <clopts.hh>
+#include <filesystem>
+#include <print>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <base/Base.hh>
+#include <base/Text.hh>
+
+#include <xkb++/compose.hh>
+#include <xkb++/kb.hh>
+#include <xkb++/layout.hh>
+#include <xkb++/main.hh>
+
+using namespace base;
+namespace fs = std::filesystem;
+
+// ============================================================================
+//  Input Generation
+// ============================================================================
+/// Parameters for a synthetic .kb file.
+struct GeneratorOptions {
+    /// Number of records.
+    usz records = 1'000;
+
+    /// Number of groups per record.
+    usz groups = 1;
+
+    /// Number of comment lines per record.
+    usz comment_lines = 2;
+
+    /// Seed for the random number generator, so inputs are reproducible.
+    u32 seed = 42;
+};
+
+/// Generate a .kb file that resembles what we actually write, only larger.
+auto GenerateLayout(const GeneratorOptions& opts) -> std::string {
+    static constexpr std::array SingleChars{
+        "a"sv, "Q"sv, "1"sv, "ß"sv, "æ"sv, "ʃ"sv, "ɣ"sv, "θ"sv,
+        "λ"sv, "ω"sv, "→"sv, "€"sv, "₁"sv, "‽"sv, "ʔ"sv, "👀"sv,
+    };
+
+    static constexpr std::array Names{
+        "dead_acute"sv, "dead_grave"sv, "dead_circumflex"sv, "dead_tilde"sv,
+        "dead_belowdiaeresis"sv, "dead_abovereversedcomma"sv, "NoSymbol"sv, "ISO_Level3_Shift"sv,
+    };
+
+    std::mt19937 rng{opts.seed};
+    const auto Pick = [&](usz n) { return usz(rng() % n); };
+
+    std::string out;
+    out.reserve(opts.records * (64 + 48 * opts.comment_lines) * opts.groups);
+    for (usz r = 0; r < opts.records; r++) {
+        for (usz c = 0; c < opts.comment_lines; c++)
+            std::format_to(std::back_inserter(out), "# Record {}: '{}' ⟨comment line {}⟩ with \"quotes\"\n", r, SingleChars[Pick(SingleChars.size())], c);
+
+        std::format_to(std::back_inserter(out), "<K{:03X}> = ", r);
+        for (usz g = 0; g < opts.groups; g++) {
+            out += "[";
+            for (usz level = 0; level < kb::LAYER_COUNT; level++) {
+                switch (Pick(8)) {
+                    default: std::format_to(std::back_inserter(out), " {}", SingleChars[Pick(SingleChars.size())]); break;
+                    case 0: std::format_to(std::back_inserter(out), " {}", Names[Pick(Names.size())]); break;
+                    case 1: std::format_to(std::back_inserter(out), " \"{}\"", Names[Pick(Names.size())]); break;
+                    case 2: out += " \" \""; break;
+                    case 3: out += " '\"'"; break;
+                }
+            }
+            out += " ]";
+        }
+
+        out += " # Trailing comment\n\n";
+    }
+
+    return out;
+}
+
+// ============================================================================
+//  Benchmark Harness
+// ============================================================================
+/// Keep the compiler from optimising away a value.
+template <typename T>
+void DoNotOptimise(const T& value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct BenchmarkOptions {
+    std::chrono::nanoseconds min_time;
+    std::string filter;
+};
+
+/// Run a benchmark until it has taken at least the minimum time, and print
+/// a line of JSON with the results; 'bytes' and 'items' are per iteration.
+template <typename Callable>
+void Run(
+    const BenchmarkOptions& opts,
+    std::string_view name,
+    usz size,
+    usz bytes,
+    usz items,
+    Callable fn
+) {
+    if (not name.contains(opts.filter)) return;
+
+    // Warm up caches (ours and the CPU’s) first.
+    fn();
+
+    using Clock = std::chrono::steady_clock;
+    std::vector<double> samples;
+    Clock::duration total{};
+    while (total < opts.min_time or samples.size() < 5) {
+        auto start = Clock::now();
+        fn();
+        auto elapsed = Clock::now() - start;
+        total += elapsed;
+        samples.push_back(std::chrono::duration<double, std::nano>(elapsed).count());
+    }
+
+    std::ranges::sort(samples);
+    auto median = samples[samples.size() / 2];
+    auto mean = std::chrono::duration<double, std::nano>(total).count() / double(samples.size());
+    std::println(
+        R"({{"name":"{}","size":{},"iterations":{},"min_ns":{:.0f},"median_ns":{:.0f},"mean_ns":{:.0f},"bytes_per_sec":{:.0f},"items_per_sec":{:.0f}}})",
+        name,
+        size,
+        samples.size(),
+        samples.front(),
+        median,
+        mean,
+        double(bytes) * 1e9 / median,
+        double(items) * 1e9 / median
+    );
+}
+
+// ============================================================================
+//  Benchmarks
+// ============================================================================
+void BenchParser(const BenchmarkOptions& opts, usz records, usz groups) {
+    auto input = GenerateLayout({.records = records, .groups = groups});
+    auto suffix = groups == 1 ? std::string{} : std::format("/{}-groups", groups);
+    Run(opts, "parse" + suffix, records, input.size(), records, [&] {
+        auto layout = kb::ParsedLayout::Parse(input);
+        DoNotOptimise(layout);
+    });
+
+    auto layout = kb::ParsedLayout::Parse(input).value();
+    std::string output;
+    Run(opts, "emit" + suffix, records, input.size(), records, [&] {
+        output.clear();
+        layout.emit(output, "Benchmark");
+        DoNotOptimise(output);
+    });
+}
+
+void BenchKeySymName(const BenchmarkOptions& opts) {
+    // A spread of characters with and without XKB names, plus a name and
+    // an empty symbol; the strings must outlive the symbols.
+    static constexpr std::array<char32_t, 11> Chars{0x20, 0x7E, 0xA0, 0x17F, 0x250, 0x2AF, 0x370, 0x3FF, 0x2190, 0x21FF, 0x1F440};
+    std::vector<std::string> text;
+    for (auto c : Chars) text.push_back(text::ToUTF8(std::u32string_view{&c, 1}));
+
+    std::vector<kb::Symbol> symbols;
+    for (auto [c, s] : vws::zip(Chars, text)) symbols.push_back({.text = s, .codepoint = c});
+    symbols.push_back({.text = "dead_acute", .codepoint = 0});
+    symbols.push_back({});
+
+    Run(opts, "keysym_name", symbols.size(), 0, symbols.size(), [&] {
+        for (const auto& sym : symbols) DoNotOptimise(kb::KeySymName(sym));
+    });
+}
+
+void BenchGeometry(const BenchmarkOptions& opts) {
+    for (auto layout : {&layout::ISO105, &layout::ANSI104}) {
+        std::vector<layout::KeyGeometry> geometry(layout->num_keys());
+        for (u32 width : {layout::BASE_WIDTH / 2, layout::BASE_WIDTH, layout::BASE_WIDTH * 3}) {
+            auto name = std::format("geometry/{}", layout->name);
+            Run(opts, name, width, 0, geometry.size(), [&] {
+                layout::PlaceKeys(*layout, width, geometry);
+                DoNotOptimise(geometry);
+            });
+        }
+    }
+}
+
+void BenchCompose(const BenchmarkOptions& opts) {
+    // This depends on the system, so skip it if there is no compose file.
+    auto path = kb::LocaleComposeFile();
+    if (not path) return;
+    auto table = kb::ComposeTable::Load(*path);
+    if (not table) return;
+    auto size = fs::file_size(*path);
+    Run(opts, "compose", table->size(), size, table->size(), [&] {
+        auto t = kb::ComposeTable::Load(*path);
+        DoNotOptimise(t);
+    });
+}
+
+auto Main(int argc, char** argv) -> Result<int> {
+    using namespace command_line_options;
+    using options = clopts< // clang-format off
+        option<"--filter", "Only run benchmarks whose name contains this string">,
+        option<"--min-time", "Minimum time to run each benchmark for, in milliseconds", std::int64_t>,
+        option<"--generate", "Instead of benchmarking, print a synthetic .kb file with this many records", std::int64_t>,
+        help<>
+    >; // clang-format on
+
+    auto opts = options::parse(argc, argv);
+    if (auto records = opts.get<"--generate">()) {
+        if (*records < 0) return Error("Number of records must not be negative");
+        std::print("{}", GenerateLayout({.records = usz(*records)}));
+        return 0;
+    }
+
+    BenchmarkOptions bench{
+        .min_time = std::chrono::milliseconds(opts.get<"--min-time">(i64(200))),
+        .filter = std::string{opts.get<"--filter">("")},
+    };
+
+    // Each line of output is a JSON object, so results can be appended to
+    // a file and compared over time.
+    for (usz groups : {1zu, kb::MAX_GROUPS})
+        for (usz records : {100zu, 1'000zu, 10'000zu, 100'000zu})
+            BenchParser(bench, records, groups);
+    BenchKeySymName(bench);
+    BenchGeometry(bench);
+    BenchCompose(bench);
+    return 0;
+}
@@ -0,0 +1,272 @@
+#include <xkb++/cache.hh>
+#include <cstdlib>
+#include <cstring>
+#include <format>
+#include <fstream>
+#include <functional>
+#include <thread>
+#include <unistd.h>
+
+using namespace base;
+using namespace kb;
+namespace fs = std::filesystem;
+
+// The fragments file is 'magic, version, emitter hash, count, (hash, size,
+// bytes)...', all in native byte order since the cache is never shared
+// between machines.
+constexpr std::string_view FragmentsMagic = "XKBGFRAG";
+
+// A layout for EmitterHash() to emit: every kind of symbol, quoting, padding
+// of short groups, and several groups.
+constexpr std::string_view ProbeLayout = R"(
+<TLDE> = [ dead_acute dead_grave "dead_diaeresis" "¬" ]
+<AE01> = [ 1 ! ¡ ₁ " " '"' "#" 👀 ]
+<AE11> = [ - _ ]
+<AC01> = [ a A ] [ α Α ] [ ж Ж ] [ ̝ ]
+)";
+
+// A compose entry is 'magic, version, counts, files, nodes, results, strings',
+// where each file is 'mtime, size, hash, included, path size, path'. The
+// nodes and results start on an 8-byte boundary so they can be used in place.
+constexpr std::string_view ComposeMagic = "XKBCOMPO";
+
+auto kb::WriteAtomically(const fs::path& path, std::string_view data) -> Result<> {
+    // Make the temporary name unique across both processes and threads.
+    auto tmp = path;
+    tmp += std::format(".{}.{}.tmp", getpid(), std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+    {
+        std::ofstream f{tmp, std::ios::binary};
+        if (not f) return Error("Could not create cache entry '{}'", tmp.string());
+        f.write(data.data(), std::streamsize(data.size()));
+        if (not f) return Error("Could not write cache entry '{}'", tmp.string());
+    }
+
+    std::error_code ec;
+    fs::rename(tmp, path, ec);
+    if (ec) {
+        fs::remove(tmp, ec);
+        return Error("Could not write cache entry '{}'", path.string());
+    }
+
+    return {};
+}
+
+auto kb::EmitterHash() -> u64 {
+    auto layout = ParsedLayout::Parse(ProbeLayout, "<probe>");
+    if (not layout) return Hash(std::format("{}", layout.error()));
+    std::string out;
+    layout->emit(out, "probe");
+    return Hash(out);
+}
+
+namespace {
+auto EntryName(u64 key) -> std::string {
+    return std::format("{:016x}", key);
+}
+
+/// Check whether a file is still the same as when a table was loaded.
+auto IsUnchanged(const ComposeFile& f) -> bool {
+    std::error_code ec;
+    auto mtime = fs::last_write_time(f.path, ec);
+    auto size = ec ? 0 : fs::file_size(f.path, ec);
+    if (ec or size != f.size) return false;
+    if (i64(mtime.time_since_epoch().count()) == f.mtime) return true;
+
+    // The file has been touched, but its contents may still be the same.
+    auto file = MappedFile::Open(f.path);
+    return file and Hash(file->contents()) == f.hash;
+}
+} // namespace
+
+auto BuildCache::Create(const fs::path& dir) -> Result<std::unique_ptr<BuildCache>> {
+    std::unique_ptr<BuildCache> C{new BuildCache()};
+    C->outputs_dir = dir / "outputs";
+    C->records_dir = dir / "records";
+    C->emitter_hash = EmitterHash();
+
+    std::error_code ec;
+    fs::create_directories(C->outputs_dir, ec);
+    if (not ec) fs::create_directories(C->records_dir, ec);
+    if (ec) return Error("Could not create cache directory '{}': {}", dir.string(), ec.message());
+    return C;
+}
+
+auto BuildCache::Load(u64 key) const -> std::optional<MappedFile> {
+    auto file = MappedFile::Open((outputs_dir / EntryName(key)).string());
+    if (not file) return std::nullopt;
+    return std::move(file.value());
+}
+
+auto BuildCache::LoadFragments(std::string_view output) const -> Fragments {
+    Fragments fragments;
+    auto file = MappedFile::Open((records_dir / EntryName(Hash(output))).string());
+    if (not file) return fragments;
+
+    // A damaged file is simply ignored; we’ll overwrite it afterwards.
+    auto in = file->contents();
+    u32 version{};
+    u64 emitter{};
+    u64 count{};
+    if (not in.starts_with(FragmentsMagic)) return fragments;
+    in.remove_prefix(FragmentsMagic.size());
+    if (not Read(in, version) or version != CACHE_FORMAT_VERSION) return fragments;
+    if (not Read(in, emitter) or emitter != emitter_hash) return fragments;
+    if (not Read(in, count)) return fragments;
+    for (u64 i = 0; i < count; i++) {
+        u64 hash{};
+        u32 size{};
+        if (not Read(in, hash) or not Read(in, size) or in.size() < size) return {};
+        fragments.emplace(hash, in.substr(0, size));
+        in.remove_prefix(size);
+    }
+
+    return fragments;
+}
+
+auto BuildCache::Store(u64 key, std::string_view data) const -> Result<> {
+    return WriteAtomically(outputs_dir / EntryName(key), data);
+}
+
+auto BuildCache::StoreFragments(std::string_view output, const Fragments& fragments) const -> Result<> {
+    std::string data;
+    data += FragmentsMagic;
+    Append(data, CACHE_FORMAT_VERSION);
+    Append(data, emitter_hash);
+    Append(data, u64(fragments.size()));
+    for (const auto& [hash, text] : fragments) {
+        Append(data, hash);
+        Append(data, u32(text.size()));
+        data += text;
+    }
+
+    return WriteAtomically(records_dir / EntryName(Hash(output)), data);
+}
+
+// ============================================================================
+//  Compose Cache
+// ============================================================================
+namespace {
+auto ComposeEntryName(std::string_view path) -> std::string {
+    // Which file 'include "%L"' refers to depends on the locale.
+    std::error_code ec;
+    auto absolute = fs::absolute(path, ec);
+    auto h = Hash(ec ? std::string{path} : absolute.string());
+    h = Hash("\0"sv, h);
+    if (auto locale = LocaleComposeFile()) h = Hash(*locale, h);
+    return EntryName(h);
+}
+} // namespace
+
+auto ComposeCache::Create(const fs::path& dir) -> Result<std::unique_ptr<ComposeCache>> {
+    std::unique_ptr<ComposeCache> C{new ComposeCache()};
+    C->dir = dir / "compose";
+
+    std::error_code ec;
+    fs::create_directories(C->dir, ec);
+    if (ec) return Error("Could not create cache directory '{}': {}", dir.string(), ec.message());
+    return C;
+}
+
+auto ComposeCache::Get(std::string_view path) const -> Result<ComposeTable> {
+    if (auto table = Load(path)) return std::move(*table);
+    auto table = Try(ComposeTable::Load(path));
+
+    // Failing to update the cache only means that we’ll do more work next time.
+    (void) Store(path, table);
+    return table;
+}
+
+auto ComposeCache::Load(std::string_view path) const -> std::optional<ComposeTable> {
+    using Node = ComposeTable::Node;
+    using StoredResult = ComposeTable::StoredResult;
+    auto file = MappedFile::Open((dir / ComposeEntryName(path)).string());
+    if (not file) return std::nullopt;
+
+    // A damaged or outdated entry is simply ignored; we’ll overwrite it afterwards.
+    auto contents = file->contents();
+    auto in = contents;
+    const auto Align = [&] {
+        auto padding = (8 - (contents.size() - in.size()) % 8) % 8;
+        if (in.size() < padding) return false;
+        in.remove_prefix(padding);
+        return true;
+    };
+
+    u32 version{}, file_count{}, node_count{}, result_count{}, string_size{};
+    u64 sequence_count{};
+    if (not in.starts_with(ComposeMagic)) return std::nullopt;
+    in.remove_prefix(ComposeMagic.size());
+    if (not Read(in, version) or version != COMPOSE_CACHE_VERSION) return std::nullopt;
+    if (not Read(in, file_count) or not Read(in, node_count) or not Read(in, result_count)) return std::nullopt;
+    if (not Read(in, string_size) or not Read(in, sequence_count)) return std::nullopt;
+
+    ComposeTable table;
+    for (u32 i = 0; i < file_count; i++) {
+        ComposeFile f;
+        u8 included{};
+        u32 path_size{};
+        if (not Read(in, f.mtime) or not Read(in, f.size) or not Read(in, f.hash)) return std::nullopt;
+        if (not Read(in, included) or not Read(in, path_size) or in.size() < path_size) return std::nullopt;
+        f.path = in.substr(0, path_size);
+        f.included = included;
+        in.remove_prefix(path_size);
+        if (not IsUnchanged(f)) return std::nullopt;
+        table.file_list.push_back(std::move(f));
+    }
+
+    if (not Align() or node_count == 0 or in.size() / sizeof(Node) < node_count) return std::nullopt;
+    table.trie = {reinterpret_cast<const Node*>(in.data()), node_count};
+    in.remove_prefix(node_count * sizeof(Node));
+    if (not Align() or in.size() / sizeof(StoredResult) < result_count) return std::nullopt;
+    table.results = {reinterpret_cast<const StoredResult*>(in.data()), result_count};
+    in.remove_prefix(result_count * sizeof(StoredResult));
+    if (in.size() < string_size) return std::nullopt;
+    table.strings = in.substr(0, string_size);
+
+    // Make sure that a damaged entry can’t make us read out of bounds.
+    for (const auto& n : table.trie) {
+        if (n.first_child > node_count or n.child_count > node_count - n.first_child) return std::nullopt;
+        if (n.result != ComposeTable::NoResult and n.result >= result_count) return std::nullopt;
+    }
+
+    for (const auto& r : table.results)
+        if (r.text_offset > string_size or r.text_size > string_size - r.text_offset) return std::nullopt;
+
+    table.sequence_count = sequence_count;
+    table.mapping = std::move(file.value());
+    return table;
+}
+
+auto ComposeCache::Store(std::string_view path, const ComposeTable& table) const -> Result<> {
+    std::string data;
+    const auto Align = [&] { data.resize((data.size() + 7) & ~usz(7), '\0'); };
+    data += ComposeMagic;
+    Append(data, COMPOSE_CACHE_VERSION);
+    Append(data, u32(table.file_list.size()));
+    Append(data, u32(table.trie.size()));
+    Append(data, u32(table.results.size()));
+    Append(data, u32(table.strings.size()));
+    Append(data, u64(table.sequence_count));
+    for (const auto& f : table.file_list) {
+        Append(data, f.mtime);
+        Append(data, f.size);
+        Append(data, f.hash);
+        Append(data, u8(f.included));
+        Append(data, u32(f.path.size()));
+        data += f.path;
+    }
+
+    Align();
+    data.append(reinterpret_cast<const char*>(table.trie.data()), table.trie.size_bytes());
+    Align();
+    data.append(reinterpret_cast<const char*>(table.results.data()), table.results.size_bytes());
+    data += table.strings;
+    return WriteAtomically(dir / ComposeEntryName(path), data);
+}
+
+auto kb::DefaultCacheDir() -> Result<fs::path> {
+    if (auto dir = std::getenv("XDG_CACHE_HOME"); dir and *dir) return fs::path{dir} / "xkb++";
+    if (auto home = std::getenv("HOME"); home and *home) return fs::path{home} / ".cache" / "xkb++";
+    return Error("Cannot find the cache directory since neither XDG_CACHE_HOME nor HOME is set");
+}
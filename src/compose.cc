@@ -0,0 +1,503 @@
+#include <xkb++/compose.hh>
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <format>
+#include <functional>
+#include <unordered_map>
+
+using namespace base;
+using namespace kb;
+namespace fs = std::filesystem;
+
+namespace kb {
+/// Builds a ComposeTable.
+///
+/// While parsing, each node keeps its children in a linked list so that
+/// inserting is cheap; Finish() then lays the trie out breadth-first with
+/// sorted, contiguous children.
+class ComposeParser {
+    static constexpr u32 None = ~0u;
+
+    /// libX11 gives up at this depth as well.
+    static constexpr usz MaxIncludeDepth = 8;
+
+    struct BuildNode {
+        xkb_keysym_t keysym;
+        u32 first_child = None;
+        u32 next_sibling = None;
+        u32 result = ComposeTable::NoResult;
+    };
+
+    struct StringHash {
+        using is_transparent = void;
+        auto operator()(std::string_view s) const noexcept -> usz { return std::hash<std::string_view>{}(s); }
+    };
+
+    ComposeTable& table;
+    std::vector<BuildNode> nodes{BuildNode{.keysym = XKB_KEY_NoSymbol}};
+
+    /// The same few hundred keysym names are used over and over, and
+    /// xkb_keysym_from_name() is comparatively slow.
+    std::unordered_map<std::string, xkb_keysym_t, StringHash, std::equal_to<>> keysyms;
+
+    /// Scratch buffers for the current line.
+    std::vector<xkb_keysym_t> sequence;
+    std::string text;
+    usz depth = 0;
+
+public:
+    explicit ComposeParser(ComposeTable& table) : table{table} {}
+
+    /// Lay out the trie; nothing may be parsed after this.
+    void Finish();
+
+    /// Parse a file and everything it includes.
+    auto ParseFile(std::string_view path, bool included) -> Result<>;
+
+private:
+    auto Child(u32 node, xkb_keysym_t keysym) -> u32;
+    void Diag(ComposeDiagnostic::Kind kind, ComposeLocation loc, std::string message, std::optional<ComposeLocation> previous = std::nullopt);
+    auto FirstResult(u32 node) const -> u32;
+    void Include(std::string_view spec, ComposeLocation loc);
+    void Insert(ComposeLocation loc, ComposeResult result);
+    auto Keysym(std::string_view name) -> xkb_keysym_t;
+    void ParseLine(std::string_view line, ComposeLocation loc);
+    auto Save(ComposeResult result) -> ComposeTable::StoredResult;
+    auto Text(const ComposeTable::StoredResult& result) const -> std::string_view;
+    auto Where(ComposeLocation loc) const -> std::string;
+};
+} // namespace kb
+
+namespace {
+auto XLocaleDir() -> std::string {
+    if (auto dir = std::getenv("XLOCALEDIR"); dir and *dir) return dir;
+    return "/usr/share/X11/locale";
+}
+
+/// Normalise a locale name so that e.g. 'en_US.utf8' and 'en_US.UTF-8'
+/// compare equal.
+auto NormaliseLocale(std::string_view locale) -> std::string {
+    std::string out;
+    for (auto c : locale) {
+        if (c == '-') continue;
+        out += char(std::tolower(u8(c)));
+    }
+    return out;
+}
+
+auto Trim(std::string_view s) -> std::string_view {
+    auto start = s.find_first_not_of(" \t\r");
+    if (start == std::string_view::npos) return {};
+    return s.substr(start, s.find_last_not_of(" \t\r") - start + 1);
+}
+} // namespace
+
+// ============================================================================
+//  Parser
+// ============================================================================
+auto ComposeParser::Child(u32 node, xkb_keysym_t keysym) -> u32 {
+    for (auto c = nodes[node].first_child; c != None; c = nodes[c].next_sibling)
+        if (nodes[c].keysym == keysym) return c;
+
+    auto c = u32(nodes.size());
+    nodes.push_back({.keysym = keysym, .first_child = None, .next_sibling = nodes[node].first_child, .result = ComposeTable::NoResult});
+    nodes[node].first_child = c;
+    return c;
+}
+
+void ComposeParser::Diag(
+    ComposeDiagnostic::Kind kind,
+    ComposeLocation loc,
+    std::string message,
+    std::optional<ComposeLocation> previous
+) {
+    table.diagnostic_list.push_back({
+        .kind = kind,
+        .location = loc,
+        .message = std::move(message),
+        .previous = previous,
+    });
+}
+
+void ComposeParser::Finish() {
+    // Lay out the trie breadth-first, so the children of every node end
+    // up next to each other; 'order' maps trie nodes to build nodes.
+    auto& trie = table.trie_storage;
+    trie.clear();
+    trie.reserve(nodes.size());
+    trie.push_back({.keysym = XKB_KEY_NoSymbol, .first_child = 0, .child_count = 0, .result = nodes[0].result});
+
+    std::vector<u32> order{0};
+    std::vector<u32> children;
+    order.reserve(nodes.size());
+    for (usz i = 0; i < order.size(); i++) {
+        children.clear();
+        for (auto c = nodes[order[i]].first_child; c != None; c = nodes[c].next_sibling) children.push_back(c);
+        rgs::sort(children, {}, [&](u32 c) { return nodes[c].keysym; });
+
+        trie[i].first_child = u32(trie.size());
+        trie[i].child_count = u32(children.size());
+        for (auto c : children) {
+            trie.push_back({.keysym = nodes[c].keysym, .first_child = 0, .child_count = 0, .result = nodes[c].result});
+            order.push_back(c);
+        }
+    }
+
+    nodes.clear();
+    nodes.shrink_to_fit();
+    table.trie = table.trie_storage;
+    table.results = table.result_storage;
+    table.strings = {table.string_storage.data(), table.string_storage.size()};
+}
+
+auto ComposeParser::FirstResult(u32 node) const -> u32 {
+    while (nodes[node].result == ComposeTable::NoResult) node = nodes[node].first_child;
+    return nodes[node].result;
+}
+
+void ComposeParser::Include(std::string_view spec, ComposeLocation loc) {
+    using enum ComposeDiagnostic::Kind;
+
+    // Expand the same substitutions as libX11.
+    std::string path;
+    for (usz i = 0; i < spec.size(); i++) {
+        if (spec[i] != '%' or i + 1 == spec.size()) {
+            path += spec[i];
+            continue;
+        }
+
+        switch (auto c = spec[++i]) {
+            case '%': path += '%'; break;
+            case 'S': path += XLocaleDir(); break;
+            case 'H': {
+                auto home = std::getenv("HOME");
+                if (not home) return Diag(Syntax, loc, "Cannot expand '%H' since HOME is not set");
+                path += home;
+            } break;
+
+            case 'L': {
+                auto file = LocaleComposeFile();
+                if (not file) return Diag(Syntax, loc, std::format("{}", file.error()));
+                path += *file;
+            } break;
+
+            default: return Diag(Syntax, loc, std::format("Unknown substitution '%{}' in include", c));
+        }
+    }
+
+    if (depth == MaxIncludeDepth) return Diag(Syntax, loc, std::format("Includes nested too deeply; not including '{}'", path));
+    depth++;
+    auto res = ParseFile(path, true);
+    depth--;
+    if (not res) Diag(Syntax, loc, std::format("{}", res.error()));
+}
+
+void ComposeParser::Insert(ComposeLocation loc, ComposeResult result) {
+    using enum ComposeDiagnostic::Kind;
+
+    u32 node = 0;
+    for (auto [i, keysym] : sequence | vws::enumerate) {
+        node = Child(node, keysym);
+        if (usz(i) + 1 == sequence.size()) break;
+
+        // A shorter sequence ending here would hide this one; since the
+        // longer one is the one that was added later, it wins.
+        if (auto r = nodes[node].result; r != ComposeTable::NoResult) {
+            auto prev = table.result_locations[r];
+            Diag(
+                PrefixConflict,
+                loc,
+                std::format(
+                    "{} replaces {}, defined at {}, which is a prefix of it",
+                    FormatComposeSequence(sequence),
+                    FormatComposeSequence(std::span{sequence}.first(usz(i) + 1)),
+                    Where(prev)
+                ),
+                prev
+            );
+
+            nodes[node].result = ComposeTable::NoResult;
+            table.sequence_count--;
+        }
+    }
+
+    // Conversely, if this is a prefix of existing sequences, those win; we
+    // can’t drop them without losing more than we gain.
+    if (nodes[node].first_child != None) {
+        auto prev = table.result_locations[FirstResult(node)];
+        return Diag(
+            PrefixConflict,
+            loc,
+            std::format("{} is a prefix of a sequence defined at {}; ignoring it", FormatComposeSequence(sequence), Where(prev)),
+            prev
+        );
+    }
+
+    // Redefining a sequence is fine; that’s how user compose files
+    // override the system one.
+    if (auto r = nodes[node].result; r != ComposeTable::NoResult) {
+        auto& existing = table.result_storage[r];
+        auto prev = std::exchange(table.result_locations[r], loc);
+        if (Text(existing) == result.text and existing.keysym == result.keysym) {
+            Diag(Duplicate, loc, std::format("{} is already defined at {}", FormatComposeSequence(sequence), Where(prev)), prev);
+        } else {
+            Diag(Override, loc, std::format("{} overrides the definition at {}", FormatComposeSequence(sequence), Where(prev)), prev);
+            existing = Save(result);
+        }
+        return;
+    }
+
+    nodes[node].result = u32(table.result_storage.size());
+    table.result_storage.push_back(Save(result));
+    table.result_locations.push_back(loc);
+    table.sequence_count++;
+}
+
+auto ComposeParser::Keysym(std::string_view name) -> xkb_keysym_t {
+    if (auto it = keysyms.find(name); it != keysyms.end()) return it->second;
+    std::string key{name};
+    auto keysym = xkb_keysym_from_name(key.c_str(), XKB_KEYSYM_NO_FLAGS);
+    keysyms.emplace(std::move(key), keysym);
+    return keysym;
+}
+
+auto ComposeParser::ParseFile(std::string_view path, bool included) -> Result<> {
+    // Get the modification time first, so that if the file changes while
+    // we’re reading it, a cache sees that it is out of date.
+    std::error_code ec;
+    auto mtime = fs::last_write_time(path, ec);
+    auto file = Try(MappedFile::Open(path));
+    auto contents = file.contents();
+    auto index = u32(table.file_list.size());
+    table.file_list.push_back({
+        .path = std::string{path},
+        .mtime = ec ? 0 : i64(mtime.time_since_epoch().count()),
+        .size = contents.size(),
+        .hash = Hash(contents),
+        .included = included,
+    });
+
+    for (u32 line = 1; not contents.empty(); line++) {
+        auto nl = contents.find('\n');
+        ParseLine(contents.substr(0, nl), {.file = index, .line = line});
+        contents.remove_prefix(nl == std::string_view::npos ? contents.size() : nl + 1);
+    }
+
+    return {};
+}
+
+void ComposeParser::ParseLine(std::string_view line, ComposeLocation loc) {
+    using enum ComposeDiagnostic::Kind;
+
+    usz i = 0;
+    const auto SkipWhitespace = [&] {
+        while (i < line.size() and (line[i] == ' ' or line[i] == '\t' or line[i] == '\r')) i++;
+    };
+
+    const auto AtEnd = [&] {
+        SkipWhitespace();
+        return i == line.size() or line[i] == '#';
+    };
+
+    const auto Word = [&] {
+        auto start = i;
+        while (i < line.size() and (std::isalnum(u8(line[i])) or line[i] == '_')) i++;
+        return line.substr(start, i - start);
+    };
+
+    // Parse a string into 'text'; 'i' must be at the opening quote.
+    const auto String = [&] {
+        text.clear();
+        for (i++; i < line.size();) {
+            auto c = line[i++];
+            if (c == '"') return true;
+            if (c != '\\' or i == line.size()) {
+                text += c;
+                continue;
+            }
+
+            c = line[i++];
+            const auto Number = [&](int base, usz max_digits, usz value) {
+                for (usz n = 0; n < max_digits and i < line.size(); n++, i++) {
+                    auto d = line[i];
+                    int digit = d >= '0' and d <= '9' ? d - '0'
+                              : d >= 'a' and d <= 'f' ? d - 'a' + 10
+                              : d >= 'A' and d <= 'F' ? d - 'A' + 10
+                                                      : 99;
+                    if (digit >= base) break;
+                    value = value * usz(base) + usz(digit);
+                }
+                text += char(value);
+            };
+
+            switch (c) {
+                case 'n': text += '\n'; break;
+                case 'r': text += '\r'; break;
+                case 't': text += '\t'; break;
+                case 'x':
+                case 'X': Number(16, 2, 0); break;
+                case '0': case '1': case '2': case '3':
+                case '4': case '5': case '6': case '7': Number(8, 2, usz(c - '0')); break;
+                default: text += c; break;
+            }
+        }
+        return false;
+    };
+
+    if (AtEnd()) return;
+    if (line.substr(i).starts_with("include")) {
+        i += "include"sv.size();
+        SkipWhitespace();
+        if (i == line.size() or line[i] != '"' or not String()) return Diag(Syntax, loc, "Expected a quoted path after 'include'");
+        if (not AtEnd()) return Diag(Syntax, loc, "Unexpected text after include");
+        return Include(text, loc);
+    }
+
+    // Events. Modifiers are accepted but ignored, as in libxkbcommon.
+    sequence.clear();
+    for (;;) {
+        if (AtEnd()) return Diag(Syntax, loc, "Expected ':' after the sequence");
+        if (line[i] == ':') {
+            i++;
+            break;
+        }
+
+        if (line[i] == '<') {
+            auto end = line.find('>', i);
+            if (end == std::string_view::npos) return Diag(Syntax, loc, "Unterminated keysym name");
+            auto name = line.substr(i + 1, end - i - 1);
+            i = end + 1;
+
+            auto keysym = Keysym(name);
+            if (keysym == XKB_KEY_NoSymbol) return Diag(UnknownKeysym, loc, std::format("Unknown keysym '{}'", name));
+            sequence.push_back(keysym);
+            continue;
+        }
+
+        if (line[i] == '!' or line[i] == '~') {
+            i++;
+            continue;
+        }
+
+        if (Word().empty()) return Diag(Syntax, loc, std::format("Unexpected character '{}'", line[i]));
+    }
+
+    if (sequence.empty()) return Diag(Syntax, loc, "Empty sequence");
+
+    // Result: a string, a keysym, or both.
+    ComposeResult result;
+    text.clear();
+    SkipWhitespace();
+    if (i < line.size() and line[i] == '"' and not String()) return Diag(Syntax, loc, "Unterminated string");
+    result.text = text;
+    if (not AtEnd()) {
+        auto name = Word();
+        if (name.empty()) return Diag(Syntax, loc, std::format("Unexpected character '{}'", line[i]));
+        result.keysym = Keysym(name);
+        if (result.keysym == XKB_KEY_NoSymbol) return Diag(UnknownKeysym, loc, std::format("Unknown keysym '{}'", name));
+        if (not AtEnd()) return Diag(Syntax, loc, "Unexpected text after the result");
+    }
+
+    if (result.text.empty() and result.keysym == XKB_KEY_NoSymbol) return Diag(Syntax, loc, "Sequence has no result");
+    Insert(loc, result);
+}
+
+auto ComposeParser::Save(ComposeResult result) -> ComposeTable::StoredResult {
+    auto offset = u32(table.string_storage.size());
+    table.string_storage.insert(table.string_storage.end(), result.text.begin(), result.text.end());
+    return {.text_offset = offset, .text_size = u32(result.text.size()), .keysym = result.keysym};
+}
+
+auto ComposeParser::Text(const ComposeTable::StoredResult& result) const -> std::string_view {
+    return {table.string_storage.data() + result.text_offset, result.text_size};
+}
+
+auto ComposeParser::Where(ComposeLocation loc) const -> std::string {
+    return std::format("{}:{}", table.file_list[loc.file].path, loc.line);
+}
+
+// ============================================================================
+//  API
+// ============================================================================
+auto ComposeTable::find(NodeIndex node, xkb_keysym_t keysym) const -> std::optional<NodeIndex> {
+    auto c = children(node);
+    auto it = rgs::lower_bound(c, keysym, {}, &Node::keysym);
+    if (it == c.end() or it->keysym != keysym) return std::nullopt;
+    return NodeIndex(trie[node].first_child + usz(it - c.begin()));
+}
+
+auto ComposeTable::lookup(std::span<const xkb_keysym_t> sequence) const -> std::optional<NodeIndex> {
+    NodeIndex node = Root;
+    for (auto keysym : sequence) {
+        auto child = find(node, keysym);
+        if (not child) return std::nullopt;
+        node = *child;
+    }
+    return node;
+}
+
+auto ComposeTable::Load(std::string_view path) -> Result<ComposeTable> {
+    ComposeTable table;
+    ComposeParser parser{table};
+    Try(parser.ParseFile(path, false));
+    parser.Finish();
+    return table;
+}
+
+auto kb::DefaultComposeFile() -> Result<std::string> {
+    if (auto file = std::getenv("XCOMPOSEFILE"); file and *file) return std::string{file};
+    if (auto home = std::getenv("HOME"); home and *home) {
+        auto path = std::format("{}/.XCompose", home);
+        std::error_code ec;
+        if (fs::exists(path, ec)) return path;
+    }
+    return LocaleComposeFile();
+}
+
+auto kb::FormatComposeSequence(std::span<const xkb_keysym_t> sequence) -> std::string {
+    std::string out;
+    char name[64];
+    for (auto keysym : sequence) {
+        if (not out.empty()) out += ' ';
+        if (xkb_keysym_get_name(keysym, name, sizeof name) < 0) std::format_to(std::back_inserter(out), "<{:#x}>", keysym);
+        else std::format_to(std::back_inserter(out), "<{}>", name);
+    }
+    return out;
+}
+
+auto kb::LocaleComposeFile() -> Result<std::string> {
+    // Same precedence as setlocale(LC_CTYPE, "").
+    std::string_view locale;
+    for (auto var : {"LC_ALL", "LC_CTYPE", "LANG"}) {
+        if (auto value = std::getenv(var); value and *value) {
+            locale = value;
+            break;
+        }
+    }
+
+    // Like libxkbcommon, treat the C locale as en_US.UTF-8, since the C
+    // compose file is practically empty.
+    if (locale.empty() or locale == "C" or locale == "POSIX") locale = "en_US.UTF-8";
+
+    // Each line of compose.dir is 'file: locale'.
+    auto dir = XLocaleDir();
+    auto compose_dir = Try(MappedFile::Open(dir + "/compose.dir"));
+    auto normalised = NormaliseLocale(locale);
+    auto contents = compose_dir.contents();
+    while (not contents.empty()) {
+        auto nl = contents.find('\n');
+        auto line = Trim(contents.substr(0, nl));
+        contents.remove_prefix(nl == std::string_view::npos ? contents.size() : nl + 1);
+        if (line.empty() or line.starts_with('#')) continue;
+
+        auto colon = line.find(':');
+        if (colon == std::string_view::npos) continue;
+        auto name = Trim(line.substr(colon + 1));
+        if (name == locale or NormaliseLocale(name) == normalised)
+            return std::format("{}/{}", dir, Trim(line.substr(0, colon)));
+    }
+
+    return Error("No compose file for locale '{}' in '{}/compose.dir'", locale, dir);
+}
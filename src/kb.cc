@@ -0,0 +1,417 @@
+#include <xkb++/kb.hh>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <format>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace base;
+using namespace kb;
+
+// ============================================================================
+//  Helpers
+// ============================================================================
+auto kb::Hash(std::string_view data, u64 seed) -> u64 {
+    for (auto c : data) {
+        seed ^= u8(c);
+        seed *= 0x100'0000'01B3;
+    }
+    return seed;
+}
+
+auto kb::FormatLocation(std::string_view filename, std::string_view text, usz offset) -> std::string {
+    auto before = text.substr(0, offset);
+    auto line_start = before.rfind('\n');
+    line_start = line_start == std::string_view::npos ? 0 : line_start + 1;
+    auto line = usz(std::ranges::count(before, '\n')) + 1;
+    auto col = usz(std::ranges::count_if(before.substr(line_start), [](char c) { return (u8(c) & 0xC0) != 0x80; })) + 1;
+    return std::format("{}:{}:{}", filename, line, col);
+}
+
+auto kb::KeySymName(const Symbol& sym) -> std::string_view {
+    // Symbol is the empty symbol.
+    if (sym.text.empty()) return "NoSymbol";
+
+    // Symbol is the name of a symbol.
+    if (not sym.codepoint) return sym.text;
+
+    // Symbol is a single character; look up its name the first time we
+    // see it. Each thread has its own table so workers don’t contend.
+    thread_local std::unordered_map<char32_t, std::string> names;
+    auto [it, inserted] = names.try_emplace(sym.codepoint);
+    if (not inserted) return it->second;
+
+    // It may have a name in XKB.
+    std::array<char, 64> buf;
+    auto x = xkb_utf32_to_keysym(sym.codepoint);
+    auto sz = xkb_keysym_get_name(x, buf.data(), buf.size());
+
+    // It does not.
+    if (sz < 0 or usz(sz) >= buf.size()) it->second = std::format("U{:04X}", usz(sym.codepoint));
+
+    // It does.
+    else it->second.assign(buf.data(), usz(sz));
+    return it->second;
+}
+
+// ============================================================================
+//  Files
+// ============================================================================
+MappedFile& MappedFile::operator=(MappedFile&& other) noexcept {
+    if (this != &other) {
+        this->~MappedFile();
+        data = std::exchange(other.data, {});
+    }
+    return *this;
+}
+
+MappedFile::~MappedFile() {
+    if (not data.empty()) munmap(const_cast<char*>(data.data()), data.size());
+}
+
+auto MappedFile::Open(std::string_view path) -> Result<MappedFile> {
+    std::string p{path};
+    auto fd = open(p.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return Error("Could not open '{}': {}", path, std::strerror(errno));
+
+    struct stat st{};
+    if (fstat(fd, &st) < 0) {
+        auto err = errno;
+        close(fd);
+        return Error("Could not stat '{}': {}", path, std::strerror(err));
+    }
+
+    // mmap() rejects empty mappings.
+    if (st.st_size == 0) {
+        close(fd);
+        return MappedFile{std::string_view{}};
+    }
+
+    auto size = usz(st.st_size);
+    auto ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto err = errno;
+    close(fd);
+    if (ptr == MAP_FAILED) return Error("Could not map '{}': {}", path, std::strerror(err));
+    return MappedFile{std::string_view{static_cast<const char*>(ptr), size}};
+}
+
+// ============================================================================
+//  Layout Implementation
+// ============================================================================
+auto StringArena::save(std::string_view s) -> std::string_view {
+    if (s.empty()) return {};
+    if (s.size() > remaining) {
+        auto size = std::max(ChunkSize, s.size());
+        chunks.push_back(std::make_unique<char[]>(size));
+        ptr = chunks.back().get();
+        remaining = size;
+    }
+
+    std::memcpy(ptr, s.data(), s.size());
+    std::string_view saved{ptr, s.size()};
+    ptr += s.size();
+    remaining -= s.size();
+    return saved;
+}
+
+void ParsedLayout::emit(std::string& o, std::string_view kb_name) const {
+    // Most records are a key name and 8 short symbols per group.
+    o.reserve(o.size() + 512 + size() * max_groups * 128);
+    emit_header(o, kb_name);
+    for (usz i = 0; i < size(); i++) emit_record(o, i);
+    emit_footer(o);
+}
+
+void ParsedLayout::emit_header(std::string& o, std::string_view kb_name) const {
+    o += "default xkb_symbols \"basic\" {\n";
+    std::format_to(std::back_inserter(o), "    name[Group1]=\"{}\";\n", kb_name);
+    o += "\n";
+    for (usz g = 1; g <= max_groups; g++)
+        std::format_to(std::back_inserter(o), "    key.type[Group{}] = \"EIGHT_LEVEL\";\n", g);
+}
+
+void ParsedLayout::emit_footer(std::string& o) const {
+    // Write modifier keys.
+    o += "\n";
+    o += "    key.type[Group1] = \"ONE_LEVEL\";\n";
+    o += "    key <RALT> { [ ISO_Level3_Shift ] };\n";
+    o += "    key <RWIN> { [ ISO_Level5_Shift ] };\n";
+    o += "    key <MENU> { [ ISO_Level5_Shift ] };\n";
+    o += "\n";
+    o += "    include \"level3(ralt_switch)\"\n";
+    o += "    include \"level5(menu_switch)\"\n";
+    o += "};\n";
+}
+
+void ParsedLayout::emit_record(std::string& o, usz index) const {
+    o += "    key <";
+    o += names[index];
+    o += "> { ";
+    for (usz g = 0; g < group_count(index); g++) {
+        if (g != 0) o += ", ";
+        o += "[";
+        auto symbols = record_symbols(index, g);
+        bool first = true;
+        for (auto id : symbols) {
+            if (first) first = false;
+            else o += ", ";
+            o += keysym_names[id];
+        }
+
+        // Pad with empty symbol to level count; an empty group has no
+        // symbols before the padding, so it must not start with a comma.
+        for (usz i = symbols.size(); i < LAYER_COUNT; i++) {
+            if (i != 0) o += ", ";
+            o += "NoSymbol";
+        }
+        o += "]";
+    }
+    o += " };\n";
+}
+
+auto ParsedLayout::record_hash(usz index) const -> u64 {
+    // Include the lengths so that e.g. ['ab', 'c'] and ['a', 'bc'] differ.
+    const auto HashSize = [](usz size, u64 h) {
+        auto len = u32(size);
+        return Hash({reinterpret_cast<const char*>(&len), sizeof len}, h);
+    };
+
+    auto h = Hash(names[index]);
+    for (usz g = 0; g < group_count(index); g++) {
+        auto symbols = record_symbols(index, g);
+        h = HashSize(symbols.size(), h);
+        for (auto id : symbols) {
+            h = HashSize(pool[id].text.size(), h);
+            h = Hash(pool[id].text, h);
+        }
+    }
+    return h;
+}
+
+// ============================================================================
+//  Parser
+// ============================================================================
+namespace {
+constexpr std::string_view Whitespace = " \t\n\r\v\f";
+
+auto Trim(std::string_view s) -> std::string_view {
+    auto start = s.find_first_not_of(Whitespace);
+    if (start == std::string_view::npos) return {};
+    auto end = s.find_last_not_of(Whitespace);
+    return s.substr(start, end - start + 1);
+}
+
+/// Decode a symbol if it is a single UTF-8 encoded character; returns
+/// 0 if it is longer, and -1 if it is not valid UTF-8.
+auto DecodeSingle(std::string_view s) -> i32 {
+    auto lead = u8(s.front());
+    auto len = lead < 0x80            ? 1zu
+             : (lead & 0xE0) == 0xC0 ? 2zu
+             : (lead & 0xF0) == 0xE0 ? 3zu
+             : (lead & 0xF8) == 0xF0 ? 4zu
+                                      : 0zu;
+
+    if (len == 0) return -1;
+    constexpr std::array<u8, 4> LeadMasks{0x7F, 0x1F, 0x0F, 0x07};
+    auto c = char32_t(lead & LeadMasks[len - 1]);
+
+    // Multi-character symbols are keysym names, which are never decoded.
+    if (s.size() > len) return 0;
+    if (s.size() < len) return -1;
+    for (auto b : s.substr(1)) {
+        if ((u8(b) & 0xC0) != 0x80) return -1;
+        c = (c << 6) | char32_t(u8(b) & 0x3F);
+    }
+
+    return i32(c);
+}
+} // namespace
+
+/// Single-pass tokeniser for .kb files.
+class kb::Parser {
+    ParsedLayout& layout;
+    std::string_view text;
+    std::string_view filename;
+    usz pos = 0;
+
+    /// Symbols we’ve already seen, by their text in the source.
+    std::unordered_map<std::string_view, u32> interned;
+
+public:
+    Parser(ParsedLayout& layout, std::string_view text, std::string_view filename)
+        : layout{layout}, text{text}, filename{filename} {}
+
+    auto Parse() -> Result<>;
+
+private:
+    auto at_end() const -> bool { return pos == text.size(); }
+    auto consume(char c) -> bool;
+    auto Intern(std::string_view sym, char32_t codepoint) -> u32;
+    auto location(usz at) const -> std::string;
+    auto peek() const -> char { return at_end() ? '\0' : text[pos]; }
+    auto ParseGroup() -> Result<>;
+    auto ParseSymbol() -> Result<u32>;
+    void skip_whitespace_and_comments();
+};
+
+auto Parser::consume(char c) -> bool {
+    if (peek() != c) return false;
+    pos++;
+    return true;
+}
+
+auto Parser::location(usz at) const -> std::string {
+    // Only compute the location once we actually need it.
+    return FormatLocation(filename, text, at);
+}
+
+void Parser::skip_whitespace_and_comments() {
+    while (not at_end()) {
+        if (Whitespace.contains(text[pos])) {
+            pos++;
+        } else if (text[pos] == '#') {
+            auto nl = text.find('\n', pos);
+            pos = nl == std::string_view::npos ? text.size() : nl + 1;
+        } else {
+            break;
+        }
+    }
+}
+
+auto Parser::Intern(std::string_view sym, char32_t codepoint) -> u32 {
+    auto [it, inserted] = interned.try_emplace(sym, u32(layout.pool.size()));
+    if (inserted) {
+        // Keysym names of single characters point into a thread-local table,
+        // so copy them; all other names are the symbol itself.
+        auto& saved = layout.pool.emplace_back(layout.arena.save(sym), codepoint);
+        auto name = KeySymName(saved);
+        layout.keysym_names.push_back(codepoint ? layout.arena.save(name) : name);
+    }
+    return it->second;
+}
+
+auto Parser::ParseGroup() -> Result<> {
+    for (;;) {
+        skip_whitespace_and_comments();
+        if (at_end()) return Error("{}: Expected ']' after key symbols", location(pos));
+        if (consume(']')) break;
+        layout.slots.push_back(Try(ParseSymbol()));
+    }
+
+    layout.group_symbols.push_back(u32(layout.slots.size()));
+    return {};
+}
+
+auto Parser::ParseSymbol() -> Result<u32> {
+    auto start = pos;
+    std::string_view sym;
+
+    // Quoted symbol.
+    if (auto q = peek(); q == '"' or q == '\'') {
+        auto end = text.find(q, pos + 1);
+        if (end == std::string_view::npos) return Error("{}: Unterminated quoted symbol", location(start));
+        sym = Trim(text.substr(pos + 1, end - pos - 1));
+        pos = end + 1;
+    }
+
+    // Bare symbol; this ends at whitespace, ']', or a comment.
+    else {
+        auto end = text.find_first_of(" \t\n\r\v\f]#", pos);
+        if (end == std::string_view::npos) end = text.size();
+        sym = text.substr(pos, end - pos);
+        pos = end;
+    }
+
+    if (sym.empty()) return 0;
+    auto c = DecodeSingle(sym);
+    if (c < 0) return Error("{}: Invalid UTF-8 in symbol", location(start));
+    return Intern(sym, char32_t(c));
+}
+
+auto Parser::Parse() -> Result<> {
+    if (text.size() > std::numeric_limits<u32>::max()) return Error("{}: File is too large", filename);
+
+    // Index 0 is always the empty symbol.
+    layout.pool.emplace_back();
+    layout.keysym_names.push_back(KeySymName({}));
+    for (;;) {
+        skip_whitespace_and_comments();
+        if (at_end()) return {};
+        auto record_start = pos;
+        if (not consume('<')) return Error("{}: Expected '<' at start of key name", location(pos));
+
+        // Read symbolic key name.
+        auto end = text.find_first_of(">\n", pos);
+        if (end == std::string_view::npos or text[end] != '>')
+            return Error("{}: Expected '>' at end of key name", location(std::min(end, text.size())));
+        layout.names.push_back(layout.arena.save(text.substr(pos, end - pos)));
+        layout.offsets.push_back(u32(record_start));
+        pos = end + 1;
+
+        // Read '='.
+        skip_whitespace_and_comments();
+        if (not consume('=')) return Error("{}: Expected '=' after key index", location(pos));
+
+        // Read one bracketed list of symbols per group.
+        usz groups = 0;
+        for (;;) {
+            skip_whitespace_and_comments();
+            auto group_start = pos;
+            if (not consume('[')) {
+                if (groups != 0) break;
+                return Error("{}: Expected '[' before key symbols", location(pos));
+            }
+
+            if (++groups > MAX_GROUPS) return Error("{}: A key can have at most {} groups", location(group_start), MAX_GROUPS);
+            Try(ParseGroup());
+        }
+
+        layout.record_groups.push_back(u32(layout.group_symbols.size() - 1));
+        layout.max_groups = std::max(layout.max_groups, groups);
+    }
+}
+
+auto ParsedLayout::Parse(std::string_view text, std::string_view filename) -> Result<ParsedLayout> {
+    ParsedLayout layout;
+    Try(Parser{layout, text, filename}.Parse());
+    return layout;
+}
+
+// ============================================================================
+//  Keymap Compilation
+// ============================================================================
+auto kb::CompileKeymap(xkb_context* ctx, const ParsedLayout& layout, std::string_view name) -> Result<xkb_keymap*> {
+    auto source = KeymapSource(layout, name);
+    auto keymap = xkb_keymap_new_from_buffer(
+        ctx,
+        source.data(),
+        source.size(),
+        XKB_KEYMAP_FORMAT_TEXT_V1,
+        XKB_KEYMAP_COMPILE_NO_FLAGS
+    );
+
+    if (not keymap) return Error("Failed to compile keymap for '{}'", name);
+    return keymap;
+}
+
+auto kb::KeymapSource(const ParsedLayout& layout, std::string_view name, usz* first_record_line) -> std::string {
+    std::string source;
+    source += "xkb_keymap {\n";
+    source += "    xkb_keycodes { include \"evdev+aliases(qwerty)\" };\n";
+    source += "    xkb_types { include \"complete\" };\n";
+    source += "    xkb_compat { include \"complete\" };\n";
+    layout.emit_header(source, name);
+    if (first_record_line) *first_record_line = usz(std::ranges::count(source, '\n')) + 1;
+    for (usz i = 0; i < layout.size(); i++) layout.emit_record(source, i);
+    layout.emit_footer(source);
+    source += "};\n";
+    return source;
+}
@@ -0,0 +1,121 @@
+#include <xkb++/keymap.hh>
+#include <iterator>
+#include <ranges>
+
+#include <base/Text.hh>
+
+using namespace base;
+
+namespace {
+/// Combining characters for the dead keysyms, starting at dead_grave.
+constexpr char32_t DeadKeyChars[]{ // clang-format off
+    // 0xFE50
+    U'\u0300', U'\u0301', U'\u0302', U'\u0303', U'\u0304', U'\u0306', U'\u0307', U'\u0308',
+    U'\u030A', U'\u030B', U'\u030C', U'\u0327', U'\u0328', U'\u0345', U'\u3099', U'\u309A',
+
+    // 0xFE60
+    U'\u0323', U'\u0309', U'\u031B', U'\u0335', U'\u0313', U'\u0314', U'\u030F', U'\u0325',
+    U'\u0331', U'\u032D', U'\u0330', U'\u032E', U'\u0324', U'\u0311', U'\u0326', U'\u00A4',
+
+    // 0xFE70 (AccessX and pointer keys, not dead keys).
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+
+    // 0xFE80
+    U'a', U'A', U'e', U'E', U'i', U'I', U'o', U'O',
+    U'u', U'U', U'ə', U'Ə', 0, 0, 0, 0,
+
+    // 0xFE90
+    U'\u0332', U'\u030D', U'\u0329', U'\u0338',
+}; // clang-format on
+
+static_assert(std::size(DeadKeyChars) == 0xFE94 - 0xFE50);
+
+auto ModMask(xkb_keymap* keymap, const char* name) -> xkb_mod_mask_t {
+    auto idx = xkb_keymap_mod_get_index(keymap, name);
+    if (idx == XKB_MOD_INVALID) return 0;
+    return xkb_mod_mask_t(1) << idx;
+}
+} // namespace
+
+auto xkb::DisplayText(const Symbol& sym) -> std::u32string {
+    std::u32string text;
+    if (sym.codepoint) text = sym.codepoint;
+    if (IsDiacritic(sym)) text.insert(0, U"◌");
+    return text;
+}
+
+bool xkb::IsDiacritic(const Symbol& sym) {
+    if (sym.keysym == XKB_KEY_NoSymbol) return false;
+    if (sym.dead) return true;
+    if (not sym.codepoint) return false;
+    switch (c32(sym.codepoint).category()) {
+        default: return false;
+        case text::CharCategory::CombiningSpacingMark:
+        case text::CharCategory::EnclosingMark:
+        case text::CharCategory::NonSpacingMark:
+        case text::CharCategory::ConnectorPunctuation:
+            return true;
+    }
+}
+
+auto xkb::KeysymToUTF32(xkb_keysym_t sym) -> char32_t {
+    // Latin-1 keysyms are identical to the corresponding codepoints.
+    if ((sym >= 0x20 and sym <= 0x7E) or (sym >= 0xA0 and sym <= 0xFF)) return char32_t(sym);
+
+    // Unicode keysyms are the codepoint plus a fixed offset.
+    if (sym >= 0x0100'0000 and sym <= 0x0110'FFFF) return char32_t(sym - 0x0100'0000);
+
+    // libxkbcommon doesn’t map dead keys to anything.
+    if (IsDeadKeysym(sym)) return DeadKeyChars[sym - 0xFE50];
+
+    // Everything else requires a lookup in libxkbcommon’s table.
+    return char32_t(xkb_keysym_to_utf32(sym));
+}
+
+void xkb::ResolveLevels(
+    xkb_keymap* keymap,
+    xkb_layout_index_t group,
+    std::span<const KeyCode> keycodes,
+    std::span<KeyLevels> out
+) {
+    Assert(keycodes.size() == out.size(), "Output must have one entry per key");
+    const auto shift = ModMask(keymap, XKB_MOD_NAME_SHIFT);
+    const auto mod3 = ModMask(keymap, "Mod3");
+    const auto mod5 = ModMask(keymap, "Mod5");
+    const std::array<xkb_mod_mask_t, LEVEL_COUNT> level_mods{
+        0,
+        shift,
+        mod5,
+        shift | mod5,
+        mod3,
+        shift | mod3,
+        mod5 | mod3,
+        mod5 | mod3 | shift,
+    };
+
+    // Rather than looking up every key for each modifier combination, set
+    // the modifiers once and then look up what level each key is on.
+    auto state = xkb_state_new(keymap);
+    Assert(state, "Failed to create keyboard state");
+    for (auto [level, mods] : level_mods | vws::enumerate) {
+        xkb_state_update_mask(state, mods, 0, 0, 0, 0, group);
+        for (auto [code, levels] : vws::zip(keycodes, out)) {
+            auto& sym = levels[usz(level)];
+            sym = {};
+
+            auto layout = xkb_state_key_get_layout(state, code);
+            if (layout == XKB_LAYOUT_INVALID) continue;
+
+            const xkb_keysym_t* syms{};
+            auto lvl = xkb_state_key_get_level(state, code, layout);
+            auto count = xkb_keymap_key_get_syms_by_level(keymap, code, layout, lvl, &syms);
+            if (count != 1) continue;
+
+            sym.keysym = syms[0];
+            sym.codepoint = KeysymToUTF32(syms[0]);
+            sym.dead = IsDeadKeysym(syms[0]);
+        }
+    }
+
+    xkb_state_unref(state);
+}
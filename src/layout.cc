@@ -1 +1,24 @@
 #include <xkb++/layout.hh>
+
+void layout::PlaceKeys(const LayoutDescription& layout, u32 width, std::span<KeyGeometry> keys) {
+    Assert(keys.size() == layout.num_keys(), "Geometry must have one entry per key");
+
+    // Everything is non-negative, so adding .5 and truncating rounds.
+    const auto w = float(width);
+    const auto Scale = [w](float f) { return int(f * w + .5f); };
+    for (auto [key, norm] : vws::zip(keys, layout.geometry)) {
+        key.border = {
+            .x = i16(Scale(norm.border[0])),
+            .y = i16(Scale(norm.border[1])),
+            .width = u16(Scale(norm.border[2])),
+            .height = u16(Scale(norm.border[3])),
+        };
+
+        for (usz level = 0; level < key.keysyms.size(); level++) {
+            key.keysyms[level] = {
+                .x = Scale(norm.keysyms[2 * level]),
+                .y = Scale(norm.keysyms[2 * level + 1]),
+            };
+        }
+    }
+}
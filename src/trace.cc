@@ -0,0 +1,108 @@
+#include <xkb++/trace.hh>
+#include <algorithm>
+#include <format>
+#include <fstream>
+#include <print>
+#include <unistd.h>
+
+using namespace base;
+using namespace trace;
+
+auto Tracer::Scope::End() -> Clock::duration {
+    if (not tracer) return {};
+    auto duration = Clock::now() - start;
+    std::exchange(tracer, nullptr)->Record(name, start, duration);
+    return duration;
+}
+
+void Tracer::Record(std::string_view name, Clock::time_point start, Clock::duration duration) {
+    if (not enabled) return;
+    if (events.size() == MaxEvents) {
+        dropped++;
+        return;
+    }
+
+    events.push_back({.name = name, .start = start, .duration = duration});
+}
+
+auto Tracer::Stats() const -> std::vector<PhaseStats> {
+    // There are only ever a handful of distinct phases, so a linear
+    // search is faster than hashing here.
+    std::vector<std::string_view> names;
+    std::vector<std::vector<Clock::duration>> durations;
+    for (const auto& e : events) {
+        auto it = rgs::find(names, e.name);
+        if (it == names.end()) {
+            names.push_back(e.name);
+            durations.emplace_back();
+            it = names.end() - 1;
+        }
+
+        durations[usz(it - names.begin())].push_back(e.duration);
+    }
+
+    // Nearest-rank percentiles.
+    std::vector<PhaseStats> stats;
+    for (auto [name, d] : vws::zip(names, durations)) {
+        rgs::sort(d);
+        const auto Percentile = [&](usz p) { return d[std::max<usz>(1, (p * d.size() + 99) / 100) - 1]; };
+        stats.push_back({
+            .name = name,
+            .count = d.size(),
+            .p50 = Percentile(50),
+            .p90 = Percentile(90),
+            .p99 = Percentile(99),
+            .max = d.back(),
+            .total = std::ranges::fold_left(d, Clock::duration{}, std::plus{}),
+        });
+    }
+
+    return stats;
+}
+
+void Tracer::PrintStats(std::FILE* stream) const {
+    const auto Ms = [](std::chrono::nanoseconds ns) { return std::chrono::duration<double, std::milli>(ns).count(); };
+    std::println(stream, "{:<20} {:>8} {:>10} {:>10} {:>10} {:>10} {:>10}", "Phase", "Count", "p50 ms", "p90 ms", "p99 ms", "max ms", "total ms");
+    for (const auto& s : Stats()) {
+        std::println(
+            stream,
+            "{:<20} {:>8} {:>10.3f} {:>10.3f} {:>10.3f} {:>10.3f} {:>10.3f}",
+            s.name,
+            s.count,
+            Ms(s.p50),
+            Ms(s.p90),
+            Ms(s.p99),
+            Ms(s.max),
+            Ms(s.total)
+        );
+    }
+
+    if (dropped) std::println(stream, "({} events were not recorded)", dropped);
+}
+
+auto Tracer::WriteChromeTrace(std::string_view path) const -> Result<> {
+    const auto Us = [](Clock::duration d) { return std::chrono::duration<double, std::micro>(d).count(); };
+
+    // Phase names are identifiers chosen by us, so they never need escaping.
+    std::string out = R"({"displayTimeUnit":"ms","traceEvents":[)";
+    auto pid = getpid();
+    for (const auto& [i, e] : events | vws::enumerate) {
+        if (i) out += ',';
+        std::format_to(
+            std::back_inserter(out),
+            R"({{"name":"{}","ph":"X","ts":{:.3f},"dur":{:.3f},"pid":{},"tid":{}}})",
+            e.name,
+            Us(e.start - epoch),
+            Us(e.duration),
+            pid,
+            pid
+        );
+    }
+    out += "]}\n";
+
+    std::ofstream f{std::string{path}, std::ios::binary};
+    if (not f) return Error("Could not open '{}' for writing", path);
+    f.write(out.data(), std::streamsize(out.size()));
+    if (not f) return Error("Could not write trace to '{}'", path);
+    return {};
+}
@@ -1,10 +1,25 @@
+#include <array>
+#include <bit>
+#include <cerrno>
 #include <chrono>
+#include <cmath>
 #include <clopts.hh>
+#include <condition_variable>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
 #include <functional>
-#include <map>
+#include <limits>
+#include <list>
+#include <mutex>
 #include <print>
 #include <ranges>
+#include <span>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include <base/Base.hh>
@@ -12,10 +27,27 @@
 
 #include <X11/X.h>
 #include <X11/Xft/Xft.h>
+#include <X11/XKBlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xlib.h>
+#include <X11/extensions/XInput2.h>
 #include <X11/Xutil.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <xkb++/cache.hh>
+#include <xkb++/compose.hh>
+#include <xkb++/kb.hh>
+#include <xkb++/keymap.hh>
 #include <xkb++/layout.hh>
 #include <xkb++/main.hh>
+#include <xkb++/trace.hh>
+#include <xcb/render.h>
+#include <xcb/xcb.h>
+#include <xkbcommon/xkbcommon-x11.h>
 
 using namespace base;
 using namespace layout;
@@ -27,8 +59,9 @@ using namespace layout;
 // ============================================================================
 //  Context and Data
 // ============================================================================
+/// Upper bound on how often we redraw; events that arrive within
+/// the same frame are coalesced into a single redraw.
 constexpr usz FPS = 144;
-constexpr int HEIGHT_TIMES_TWO = -1;
 
 struct Text {
     int x{};
@@ -37,54 +70,584 @@ struct Text {
     bool diacritic = false;
 };
 
+/// The colours that text can be drawn in. All text of the same
+/// colour is drawn in a single request.
+enum class Ink : u8 {
+    Foreground,
+    Grey,
+    Red,
+    Highlight,
+    Count,
+};
+
+/// Glyph indices and metrics of the characters we’ve drawn with a
+/// font, so we only ever have to ask Xft for them once.
+class GlyphCache {
+public:
+    struct Glyph {
+        FT_UInt index;
+        XGlyphInfo extents;
+    };
+
+private:
+    Display* display;
+    XftFont* font;
+    std::unordered_map<char32_t, Glyph> glyphs;
+
+public:
+    GlyphCache(Display* display, XftFont* font) : display{display}, font{font} {}
+
+    /// Get the extents of a string, given the glyph of each character.
+    template <typename GetGlyph>
+    static auto Extents(std::u32string_view text, GetGlyph get) -> XGlyphInfo;
+
+    /// Get a glyph.
+    auto Get(char32_t c) -> const Glyph&;
+};
+
+/// A font that is opened by file rather than by family.
+struct FontFace {
+    std::string file;
+    int index{};
+
+    /// Name of the face in the font cache; paths are absolute, so this
+    /// can’t clash with the name of a family.
+    std::string key;
+
+    /// The characters that the face has: for each page of 256 characters
+    /// that has any, its number and a bitmap, as in an FcCharSet.
+    std::vector<u32> pages;
+    std::vector<std::array<u32, 8>> bitmaps;
+
+    /// Set if the face could not be opened, so we don’t keep trying.
+    bool unusable = false;
+
+    /// Check whether the face has a character.
+    auto covers(char32_t c) const -> bool;
+};
+
+/// Fonts for the characters that the main font doesn’t have.
+///
+/// The chain is the list of fonts that fontconfig sorts by how well they
+/// match the main font, starting with the main font itself; each character
+/// is looked up in the coverage of the fonts once and then remembered. The
+/// chain is cached on disk along with the modification times of everything
+/// that fontconfig’s choice depends on, so it only has to be sorted again
+/// if fonts or the configuration have changed.
+class FontFallback {
+    /// Fonts past this point only add a handful of rare characters.
+    static constexpr usz MaxFaces = 64;
+
+    std::vector<FontFace> faces;
+    std::vector<std::pair<std::string, i64>> dependencies;
+    std::unordered_map<char32_t, u16> face_by_char;
+
+    /// Faces other than the main font that some character was found in.
+    std::vector<u16> used;
+
+    FontFallback() = default;
+
+public:
+    /// Get the fallback chain for a family.
+    static auto Create(std::string_view family) -> Result<std::unique_ptr<FontFallback>>;
+
+    /// Get a face; face 0 is the main font.
+    auto face(usz index) const -> const FontFace& { return faces[index]; }
+
+    /// Get the index of the first face that has a character; characters
+    /// that no face has are drawn with the main font.
+    auto Find(char32_t c) -> usz;
+
+    /// Stop using a face that could not be opened.
+    void MarkUnusable(usz index);
+
+    /// Get the faces other than the main font that Find() has returned.
+    auto used_faces() const -> std::span<const u16> { return used; }
+
+private:
+    auto Build(std::string_view family) -> Result<>;
+    auto Load(const std::filesystem::path& path) -> bool;
+    auto Store(const std::filesystem::path& path) const -> Result<>;
+};
+
+/// Bounded LRU cache of open fonts.
+///
+/// Opening a font is slow mostly because fontconfig has to find the best
+/// match for it. Fonts that we expect to need soon, e.g. the sizes next
+/// to the current one while the window is being resized, can be matched
+/// on a background thread ahead of time.
+///
+/// Fonts that have been used since the last call to BeginFrame() are
+/// pinned: they may still be referenced by the text of the current frame,
+/// so they are never evicted, even if that means going over capacity.
+class FontCache {
+    struct KeyView {
+        std::string_view name;
+        u32 size;
+    };
+
+    struct Key {
+        std::string name;
+        u32 size;
+        operator KeyView() const { return {name, size}; }
+    };
+
+    struct KeyHash {
+        using is_transparent = void;
+        auto operator()(KeyView k) const noexcept -> usz {
+            auto h = std::hash<std::string_view>{}(k.name);
+            return h ^ (std::hash<u32>{}(k.size) + 0x9E37'79B9 + (h << 6) + (h >> 2));
+        }
+    };
+
+    struct KeyEqual {
+        using is_transparent = void;
+        bool operator()(KeyView a, KeyView b) const noexcept {
+            return a.name == b.name and a.size == b.size;
+        }
+    };
+
+    /// A font for the worker to look up. Fonts by family are matched; fonts
+    /// by file need no matching, so only the configuration is applied.
+    struct Request {
+        Key key;
+        FcPattern* pattern;
+        bool file;
+    };
+
+    struct Entry {
+        Key key;
+        XftFont* font;
+        GlyphCache glyphs;
+
+        /// The frame in which this was last used; 0 if it hasn’t been
+        /// used since it was prefetched.
+        u64 frame{};
+    };
+
+    using EntryList = std::list<Entry>;
+
+    Display* const display;
+    const int screen;
+    const usz capacity;
+    u64 frame = 1;
+
+    /// Open fonts, most recently used first.
+    EntryList entries;
+    std::unordered_map<Key, EntryList::iterator, KeyHash, KeyEqual> by_key;
+    std::unordered_map<XftFont*, EntryList::iterator> by_font;
+
+    /// Fonts that have been handed to the worker; only accessed
+    /// on the main thread.
+    std::unordered_set<Key, KeyHash, KeyEqual> in_flight;
+
+    /// Patterns to be matched by the worker, and the matches it has
+    /// found; both are protected by the mutex.
+    std::mutex mutex;
+    std::condition_variable_any requests_changed;
+    std::deque<Request> requests;
+    std::vector<Request> matches;
+
+    /// Signalled by the worker whenever it has found a match.
+    int event_fd = -1;
+    std::jthread worker;
+
+    FontCache(Display* display, int screen, usz capacity)
+        : display{display}, screen{screen}, capacity{capacity} {}
+
+public:
+    /// Called before a font is closed, so anything that refers to
+    /// it can be released.
+    std::function<void(XftFont*)> on_close;
+
+    FontCache(const FontCache&) = delete;
+    FontCache(FontCache&&) = delete;
+    FontCache& operator=(const FontCache&) = delete;
+    FontCache& operator=(FontCache&&) = delete;
+    ~FontCache();
+
+    /// Start a new frame; fonts used in earlier frames can be evicted again.
+    void BeginFrame() { frame++; }
+
+    /// Create a new font cache.
+    static auto Create(Display* display, int screen, usz capacity) -> Result<std::unique_ptr<FontCache>>;
+
+    /// Get a font, opening it if it isn’t cached yet.
+    auto Get(std::string_view name, u32 size) -> XftFont*;
+
+    /// Get a font by file, opening it if it isn’t cached yet; unlike Get(),
+    /// this doesn’t need fontconfig to find a match. Returns nullptr if the
+    /// font can’t be opened.
+    auto GetFace(const FontFace& face, u32 size) -> XftFont*;
+
+    /// Get the glyph cache of a font returned by Get().
+    auto Glyphs(XftFont* font) -> GlyphCache&;
+
+    /// File descriptor that becomes readable when there are matches
+    /// to be processed by ProcessMatches().
+    auto notify_fd() const -> int { return event_fd; }
+
+    /// Match a font in the background so it is ready by the time we need it.
+    void Prefetch(std::string_view name, u32 size);
+
+    /// Same as Prefetch(), but for a font that GetFace() will ask for.
+    void PrefetchFace(const FontFace& face, u32 size);
+
+    /// Open the fonts that have been matched in the background.
+    void ProcessMatches();
+
+    /// Get the size that a font returned by Get() was opened at.
+    auto size(XftFont* font) const -> u32;
+
+private:
+    void Evict();
+    auto Insert(Key key, XftFont* font, bool used) -> XftFont*;
+    void Enqueue(Key key, FcPattern* pattern, bool file);
+    auto Touch(EntryList::iterator it) -> XftFont*;
+    void Match(std::stop_token stop);
+};
+
+/// Solid colours that rectangles can be filled with.
+enum class Fill : u8 {
+    Background,
+    Pressed,
+};
+
+/// Window management and drawing.
+///
+/// Both backends share the Xlib connection, which keeps owning the event
+/// queue, so only the requests that draw and manage the window differ.
+class Backend {
+public:
+    virtual ~Backend() = default;
+
+    /// Atom that the window manager sends when the window is closed.
+    virtual auto delete_window() const -> Atom = 0;
+
+    /// Clip all drawing to these areas; pass an empty span to stop clipping.
+    virtual void Clip(std::span<const XRectangle> areas) = 0;
+
+    /// Draw the outlines of rectangles into the frame.
+    virtual void DrawBorders(std::span<const XRectangle> rects) = 0;
+
+    /// Draw positioned glyphs into the frame.
+    virtual void DrawGlyphs(Ink ink, std::span<const XftGlyphFontSpec> glyphs) = 0;
+
+    /// Fill rectangles in the frame.
+    virtual void FillRectangles(Fill fill, std::span<const XRectangle> rects) = 0;
+
+    /// Send all requests that are still buffered to the server.
+    virtual void Flush() = 0;
+
+    /// Copy part of the frame to the window.
+    virtual void Present(const XRectangle& area) = 0;
+
+    /// Scale the entire frame to fill a window of a different size.
+    virtual void PresentScaled(u32 frame_width, u32 frame_height, u32 width, u32 height) = 0;
+
+    /// Resize the frame; its contents are undefined afterwards.
+    virtual void ResizeFrame(u32 width, u32 height) = 0;
+
+    /// Set the width of borders.
+    virtual void SetLineWidth(u32 width) = 0;
+
+    /// Set the window properties and map the window; it can be shrunk to
+    /// half the base size and keeps the aspect ratio of the base size.
+    virtual void Show(u32 base_width, u32 base_height) = 0;
+};
+
+/// Draws with Xlib and Xft.
+class XlibBackend final : public Backend {
+    Display* const display;
+    Window window{};
+    Atom delete_window_atom{};
+    GC gc{};
+    XWindowAttributes attrs{};
+    Pixmap frame{};
+    XftDraw* draw{};
+    XRenderPictFormat* format{};
+    Picture frame_picture{};
+    Picture window_picture{};
+    std::array<XftColor, usz(Ink::Count)> ink_colours{};
+    std::array<XftColor, 2> fill_colours{};
+
+    explicit XlibBackend(Display* display) : display{display} {}
+
+public:
+    ~XlibBackend() override;
+
+    static auto Create(Display* display, int screen, u32 width, u32 height) -> Result<std::unique_ptr<XlibBackend>>;
+
+    auto delete_window() const -> Atom override { return delete_window_atom; }
+    void Clip(std::span<const XRectangle> areas) override;
+    void DrawBorders(std::span<const XRectangle> rects) override;
+    void DrawGlyphs(Ink ink, std::span<const XftGlyphFontSpec> glyphs) override;
+    void FillRectangles(Fill fill, std::span<const XRectangle> rects) override;
+    void Flush() override;
+    void Present(const XRectangle& area) override;
+    void PresentScaled(u32 frame_width, u32 frame_height, u32 width, u32 height) override;
+    void ResizeFrame(u32 width, u32 height) override;
+    void SetLineWidth(u32 width) override;
+    void Show(u32 base_width, u32 base_height) override;
+};
+
+/// Draws with XCB and XRender.
+///
+/// Requests are only ever sent and never waited for once the window has
+/// been created; at startup, all queries are sent before we wait for any
+/// of the replies, so this takes two round trips in total. Glyphs are
+/// rendered with FreeType and uploaded to a glyph set per font the first
+/// time they’re drawn; colour glyphs are uploaded as pictures of their own
+/// instead, since glyphs in a glyph set can only be drawn in one colour.
+class XcbBackend final : public Backend {
+    struct ColourGlyph {
+        xcb_render_picture_t picture;
+        i16 left;
+        i16 top;
+        u16 width;
+        u16 height;
+    };
+
+    struct GlyphSet {
+        xcb_render_glyphset_t id;
+        std::unordered_set<FT_UInt> uploaded;
+        std::unordered_map<FT_UInt, ColourGlyph> colour;
+    };
+
+    xcb_connection_t* const conn;
+    xcb_window_t window{};
+    xcb_atom_t protocols_atom{};
+    xcb_atom_t delete_window_atom{};
+    xcb_gcontext_t gc{};
+    xcb_gcontext_t colour_gc{};
+    u8 depth{};
+    xcb_pixmap_t frame{};
+    xcb_render_picture_t frame_picture{};
+    xcb_render_picture_t window_picture{};
+    xcb_render_pictformat_t frame_format{};
+    xcb_render_pictformat_t a8_format{};
+    xcb_render_pictformat_t argb32_format{};
+    std::array<xcb_render_picture_t, usz(Ink::Count)> ink_pictures{};
+    std::array<xcb_render_color_t, 2> fill_colours{};
+    std::unordered_map<XftFont*, GlyphSet> glyph_sets;
+
+    /// Scratch buffers for requests.
+    std::vector<xcb_rectangle_t> rects_buffer;
+    std::vector<u8> glyph_commands;
+    std::vector<u8> bitmap;
+    std::vector<u8> scaled_bitmap;
+
+    explicit XcbBackend(xcb_connection_t* conn) : conn{conn} {}
+
+public:
+    ~XcbBackend() override;
+
+    static auto Create(
+        Display* display,
+        int screen,
+        FontCache& fonts,
+        u32 width,
+        u32 height
+    ) -> Result<std::unique_ptr<XcbBackend>>;
+
+    auto delete_window() const -> Atom override { return delete_window_atom; }
+    void Clip(std::span<const XRectangle> areas) override;
+    void DrawBorders(std::span<const XRectangle> rects) override;
+    void DrawGlyphs(Ink ink, std::span<const XftGlyphFontSpec> glyphs) override;
+    void FillRectangles(Fill fill, std::span<const XRectangle> rects) override;
+    void Flush() override;
+    void Present(const XRectangle& area) override;
+    void PresentScaled(u32 frame_width, u32 frame_height, u32 width, u32 height) override;
+    void ResizeFrame(u32 width, u32 height) override;
+    void SetLineWidth(u32 width) override;
+    void Show(u32 base_width, u32 base_height) override;
+
+private:
+    void Free(const GlyphSet& set);
+    auto Rects(std::span<const XRectangle> rects) -> std::span<const xcb_rectangle_t>;
+    auto Upload(XftFont* font, FT_UInt glyph) -> const GlyphSet&;
+};
+
+/// Which backend to draw with.
+enum class BackendKind : u8 {
+    Xlib,
+    XCB,
+};
+
+/// Settings chosen on the command line.
+struct DisplayOptions {
+    std::string font;
+    std::string_view layout;
+    BackendKind backend = BackendKind::Xlib;
+
+    /// Show this .kb file instead of the keymap of the server.
+    std::string kb_path;
+
+    bool highlight = false;
+
+    /// Show the compose sequences of a dead key when it is hovered or
+    /// clicked, from this compose file or the default one.
+    bool dead_keys = false;
+    std::string compose_path;
+
+    /// How long the window size must stay the same before we lay out the
+    /// keyboard again; until then, the last frame is scaled. Zero disables
+    /// scaling.
+    std::chrono::milliseconds resize_delay{};
+
+    /// Show the time and number of X requests of the last frame.
+    bool overlay = false;
+
+    /// Print phase timings on exit.
+    bool stats = false;
+
+    /// Write a Chrome trace to this file on exit, if set.
+    std::string trace_path;
+};
+
 struct Cell {
     char32_t label_char{};
     KeyCode keycode_raw;
+    bool pressed = false;
     Text keycode{};
     XRectangle* border{};
     Text label{};
     std::array<Text, 8> keysyms{};
+
+    /// The dead keysym on each level, or NoSymbol.
+    std::array<xkb_keysym_t, 8> dead_keys{};
 };
 
 class DisplayContext {
-    static constexpr u64 bgcolour = 0x2D'2A2E;
-    static constexpr u64 fgcolour = 0xFC'FCFA;
-    static constexpr u64 grey = 0x5B'595C;
-    static constexpr u32 base_width = 1'400;
-    static constexpr u32 base_height = 550;
-    static constexpr u32 base_line_width = 2;
+    static constexpr usz font_cache_size = 64;
+    static constexpr u32 base_width = BASE_WIDTH;
+    static constexpr u32 base_height = BASE_HEIGHT;
+    static constexpr u32 base_line_width = BASE_LINE_WIDTH;
 
     const LayoutDescription* layout{};
     Display* display{};
-    Window window{};
     Atom delete_window{};
-    GC gc{};
     int screen{};
-    XWindowAttributes attrs{};
     XftFont* font{};
-    XftDraw* draw{};
-    XRenderColor x_fgcolour{};
-    XRenderColor x_grey{};
-    XRenderColor x_red{};
-    XftColor xft_fgcolour{};
-    XftColor xft_grey{};
-    XftColor xft_red{};
-
-    std::vector<Text> menu_text{};
+    std::unique_ptr<Backend> backend{};
+
+    Text menu_text{};
     std::string font_name;
-    std::map<std::pair<std::string, u32>, XftFont*> font_cache{};
+    std::unique_ptr<FontCache> fonts{};
+    std::unique_ptr<FontFallback> fallback{};
+
+    /// Positioned glyphs of all text in the window, grouped by colour.
+    std::array<std::vector<XftGlyphFontSpec>, usz(Ink::Count)> glyph_runs{};
+
+    /// Fonts used for the keycodes and keysyms.
+    XftFont* keycode_font{};
+    XftFont* keysym_font{};
 
     /// Cell borders are allocated separately so we can pass them to
     /// X11 in one go.
     std::vector<Cell> cells{layout->num_keys()};
     std::vector<XRectangle> cell_borders{layout->num_keys()};
+    std::vector<KeyGeometry> geometry{layout->num_keys()};
+
+    /// Extents of the key labels in the font they were last measured in;
+    /// the size guards against a font being freed and another one being
+    /// allocated at the same address.
+    XftFont* label_extents_font{};
+    u32 label_extents_size{};
+    std::vector<XGlyphInfo> label_extents{};
 
     u32 w_width = 1'400;
     u32 w_height = 550;
     u32 font_sz;
-
-    u64 white{};
-    u64 black{};
+    u32 line_width = base_line_width;
+
+    /// Everything is rendered into a frame owned by the backend first and
+    /// then copied to the window, so exposes don’t require us to redraw
+    /// anything.
+    u32 frame_width{};
+    u32 frame_height{};
+
+    /// Extra file descriptors that the event loop waits on besides
+    /// the X connection.
+    int signal_fd = -1;
+    int timer_fd = -1;
+    bool redraw_scheduled = false;
+    std::chrono::milliseconds resize_delay{};
+
+    /// A .kb file to show instead of the keymap of the server, and the
+    /// inotify instance that watches it.
+    std::string kb_path;
+    std::string kb_name;
+    int inotify_fd = -1;
+
+    /// The keymap of the core keyboard, fetched from the server or
+    /// compiled from the .kb file.
+    xkb_context* xkb_ctx{};
+    xkb_keymap* keymap{};
+    i32 xkb_device{};
+    bool keymap_stale = false;
+
+    /// XKB event base, the active group, and the range of keycodes
+    /// whose symbols may have changed since we last resolved them.
+    int xkb_event_base{};
+    u32 group{};
+    u32 stale_first = std::numeric_limits<u32>::max();
+    u32 stale_last{};
+
+    /// Scratch buffers for re-resolving keys and for the areas that
+    /// need to be redrawn.
+    std::vector<usz> stale_cells{};
+    std::vector<KeyCode> stale_codes{};
+    std::vector<xkb::KeyLevels> resolved_levels{};
+
+    /// Areas of the frame that need to be redrawn, and areas of the window
+    /// that only need to be copied from the frame again; both are handled
+    /// by Flush() once the event queue is empty.
+    std::vector<XRectangle> damage{};
+    std::vector<XRectangle> exposed{};
+
+    /// Scratch buffers for partial redraws.
+    std::vector<usz> damaged_cells{};
+    std::vector<XRectangle> damaged_borders{};
+    std::vector<XRectangle> pressed_borders{};
+
+    /// Highlighting of pressed keys and the active level; key presses are
+    /// received as XInput 2 raw events, so they are seen regardless of which
+    /// window has the focus.
+    bool highlight = false;
+    int xi_opcode = -1;
+    usz active_level{};
+    std::array<i16, 256> cell_by_keycode{};
+
+    /// Phase timings, and what the overlay shows about the last frame.
+    trace::Tracer tracer;
+    bool print_stats = false;
+    std::string trace_path;
+    bool overlay = false;
+    Text overlay_text{};
+    XRectangle overlay_area{};
+    trace::Clock::duration last_frame_time{};
+    u64 last_frame_requests{};
+
+    /// The compose sequences of the dead key under the pointer, or of the
+    /// one that was clicked last, are shown in a panel over the half of
+    /// the keyboard that doesn’t contain the key.
+    std::optional<kb::ComposeTable> compose{};
+    xkb_keysym_t preview_keysym = XKB_KEY_NoSymbol;
+    usz preview_cell{};
+    bool preview_pinned = false;
+    std::vector<std::u32string> preview_entries{};
+    std::vector<Text> preview_text{};
+
+    /// How many elements of preview_text are shown; the rest are kept
+    /// around so their storage can be reused. Zero if there is no preview.
+    usz preview_lines{};
+    XRectangle preview_border{};
+
+    /// Text that changes from frame to frame is formatted into this first;
+    /// it and the text elements keep their storage, so that redrawing
+    /// doesn’t allocate once they’ve grown large enough.
+    std::string format_buffer{};
 
 public:
     DisplayContext(const DisplayContext&) = delete;
@@ -93,36 +656,107 @@ public:
     DisplayContext& operator=(DisplayContext&&) = delete;
     ~DisplayContext();
 
+    /// Redraw and resize the window a few times, and fail if doing so
+    /// allocates anything once the first frame at each size is drawn.
+    auto CheckAllocations() -> Result<>;
+
     /// Run the display loop.
     void Run();
 
     /// Create a new display context.
-    static auto Create(std::string font, std::string_view layout) -> Result<std::unique_ptr<DisplayContext>>;
+    static auto Create(DisplayOptions opts) -> Result<std::unique_ptr<DisplayContext>>;
+
+    /// Print statistics and write the trace, if requested.
+    auto Report() const -> Result<>;
 
 private:
-    explicit DisplayContext(const LayoutDescription* ld) : layout{ld} {}
+    DisplayContext(const LayoutDescription* ld, bool tracing) : layout{ld}, tracer{tracing} {}
 
+    auto BorderArea(const XRectangle& border) const -> XRectangle;
+    auto CellArea(const Cell& cell) const -> XRectangle;
+    void Damage(const XRectangle& area);
+    void DamageCell(usz index);
+    auto DeadKeyAt(int x, int y) const -> std::pair<usz, xkb_keysym_t>;
     void DrawCells();
-    void DrawCentredTextAt(const std::u32string& text, int xpos, int ypos);
-    void DrawTextAt(int x, int y, std::u32string text);
-    void DrawTextElem(const Text& elem, const XftColor* colour, XftFont* fnt = nullptr) const;
-    void DrawTextElems(const auto& text_elems, XftColor* colour, XftFont* fnt = nullptr) const;
-    auto Font(const std::string& name, u32 font_sz) -> XftFont*;
+    void DrawGlyphRuns();
+    void DrawPressedCells(std::span<const usz> which);
+    void CollectPreviewEntries();
+    void DrawPreview();
+    void EndFrame(trace::Tracer::Scope& frame, u64 first_request);
+    void Flush();
     void GenerateKeyboard();
     void GenerateMenuText();
+    void GenerateOverlayText();
+    void GeneratePreviewText();
+    auto GlyphFor(char32_t c, XftFont* fnt, GlyphCache& glyphs) -> std::pair<XftFont*, const GlyphCache::Glyph*>;
+    void HandleButtonPress(int x, int y);
+    void HandleFileEvents();
+    void HandleRawKeyEvent(XEvent& e);
+    void HandleXkbEvent(XEvent& e);
     void InitCells();
-    auto InitDisplay() -> Result<>;
-    auto InitFonts() -> Result<>;
+    auto InitCompose(std::string path) -> Result<>;
+    auto InitDisplay(BackendKind kind) -> Result<>;
+    auto InitEventLoop() -> Result<>;
+    auto InitHighlighting() -> Result<>;
+    auto InitKeymap() -> Result<>;
+    auto LoadKeymap() -> Result<>;
+    void MarkExposed(const XRectangle& area);
+    void MarkStale(u32 first_keycode, u32 count);
+    void PrefetchFonts();
+    void Present();
     void Redraw();
-    auto RelativeToWidth(double f) const -> u32 { return u32(w_width * f); }
-    auto RelativeToHeight(double f) const -> u32 { return u32(w_height * f); }
-    void ResolveKeysym(Text& text, KeyCode code, u32 state) const;
-    auto TextExtents(std::u32string_view t, XftFont* fnt = nullptr) const -> XGlyphInfo;
+    void RedrawAreas(std::span<const XRectangle> areas);
+    void RefreshKeys();
+    void Resize(u32 width, u32 height);
+    void ResizeFrame();
+    void ScheduleRedraw();
+    void SetPreview(usz cell, xkb_keysym_t keysym);
+    static auto ResolveCell(Cell& cell, const xkb::KeyLevels& levels) -> bool;
+    void ShapeText();
+    void ShapeText(std::span<const usz> which);
+    void ShapeCell(const Cell& cell);
+    void ShapeTextElem(const Text& elem, Ink ink, XftFont* fnt = nullptr);
+    auto TextExtents(std::u32string_view t, XftFont* fnt = nullptr) -> XGlyphInfo;
 };
 
 // ============================================================================
 //  Helpers
 // ============================================================================
+/// Get the number of heap allocations that this thread has made through
+/// operator new; defined in alloc_check.cc.
+auto AllocationCount() -> u64;
+
+/// Decode UTF-8 into a string; unlike text::ToUTF32(), this reuses the
+/// storage of the string, so it doesn’t allocate if that is large enough.
+/// Each byte that doesn’t start a valid sequence becomes U+FFFD.
+void AssignUTF32(std::u32string& out, std::string_view in) {
+    // The smallest code point that needs a sequence of each length; anything
+    // below that is an overlong encoding.
+    static constexpr std::array<char32_t, 5> Min{0, 0, 0x80, 0x800, 0x1'0000};
+
+    out.clear();
+    for (usz i = 0; i < in.size();) {
+        auto c = u8(in[i]);
+        usz len = c < 0x80 ? 1 : c < 0xC2 ? 0 : c < 0xE0 ? 2 : c < 0xF0 ? 3 : c < 0xF5 ? 4 : 0;
+        auto valid = len != 0 and i + len <= in.size();
+        auto cp = len <= 1 ? char32_t(c) : char32_t(c & (0x7F >> len));
+        for (usz k = 1; valid and k < len; k++) {
+            auto b = u8(in[i + k]);
+            valid = (b & 0xC0) == 0x80;
+            cp = cp << 6 | char32_t(b & 0x3F);
+        }
+
+        if (not valid or cp < Min[len] or (cp >= 0xD800 and cp <= 0xDFFF) or cp > 0x10'FFFF) {
+            out += U'\uFFFD';
+            i++;
+            continue;
+        }
+
+        out += cp;
+        i += len;
+    }
+}
+
 int HandleError(Display* display, XErrorEvent* e) {
     static char buffer[2'048];
     XGetErrorText(display, e->error_code, buffer, 2'048);
@@ -130,6 +764,12 @@ int HandleError(Display* display, XErrorEvent* e) {
     std::exit(1);
 }
 
+/// Get the index of the level that is active given a set of core modifiers;
+/// this is the inverse of the table in xkb::ResolveLevels().
+constexpr auto LevelFromMods(u32 mods) -> usz {
+    return (mods & ShiftMask ? 1 : 0) | (mods & Mod5Mask ? 2 : 0) | (mods & Mod3Mask ? 4 : 0);
+}
+
 constexpr auto U16Colour(u16 colour) -> u16 { return colour * 256; }
 constexpr auto XColour(u32 colour) -> XRenderColor {
     return {
@@ -140,333 +780,2198 @@ constexpr auto XColour(u32 colour) -> XRenderColor {
     };
 }
 
-bool IsDiacritic(c32 c) {
-    switch (c.category()) {
-        default: return false;
-        case text::CharCategory::CombiningSpacingMark:
-        case text::CharCategory::EnclosingMark:
-        case text::CharCategory::NonSpacingMark:
-        case text::CharCategory::ConnectorPunctuation:
-            return true;
+auto InkColour(Ink ink) -> u32 {
+    switch (ink) {
+        case Ink::Foreground: return FOREGROUND_COLOUR;
+        case Ink::Grey: return GREY_COLOUR;
+        case Ink::Red: return RED_COLOUR;
+        case Ink::Highlight: return HIGHLIGHT_COLOUR;
+        case Ink::Count: break;
+    }
+    Unreachable("Invalid ink");
+}
+
+auto FillColour(Fill fill) -> u32 {
+    switch (fill) {
+        case Fill::Background: return BACKGROUND_COLOUR;
+        case Fill::Pressed: return PRESSED_COLOUR;
+    }
+    Unreachable("Invalid fill");
+}
+
+constexpr auto RenderColour(u32 colour) -> xcb_render_color_t {
+    auto c = XColour(colour);
+    return {.red = c.red, .green = c.green, .blue = c.blue, .alpha = c.alpha};
+}
+
+/// Scale an A8 or premultiplied ARGB32 image whose rows are padded to 4
+/// bytes; each pixel of the result is the average of the pixels it covers.
+void ScaleImage(
+    const std::vector<u8>& in,
+    u32 width,
+    u32 height,
+    u32 channels,
+    std::vector<u8>& out,
+    u32 out_width,
+    u32 out_height
+) {
+    auto in_stride = (width * channels + 3) & ~3u;
+    auto out_stride = (out_width * channels + 3) & ~3u;
+    auto sx = double(width) / out_width;
+    auto sy = double(height) / out_height;
+    out.assign(usz(out_stride) * out_height, 0);
+    for (u32 y = 0; y < out_height; y++) {
+        auto y0 = u32(y * sy);
+        auto y1 = std::max(y0 + 1, std::min(height, u32((y + 1) * sy)));
+        for (u32 x = 0; x < out_width; x++) {
+            auto x0 = u32(x * sx);
+            auto x1 = std::max(x0 + 1, std::min(width, u32((x + 1) * sx)));
+            for (u32 c = 0; c < channels; c++) {
+                u32 sum = 0;
+                for (auto iy = y0; iy < y1; iy++)
+                    for (auto ix = x0; ix < x1; ix++) sum += in[usz(iy) * in_stride + ix * channels + c];
+                out[usz(y) * out_stride + x * channels + c] = u8(sum / ((y1 - y0) * (x1 - x0)));
+            }
+        }
     }
 }
 
+/// Replies from XCB are allocated with malloc().
+struct FreeDeleter {
+    void operator()(void* ptr) const { std::free(ptr); }
+};
+
+template <typename T>
+using XcbReply = std::unique_ptr<T, FreeDeleter>;
+
 // ============================================================================
 //  Initialisation and Main Loop
 // ============================================================================
 DisplayContext::~DisplayContext() {
+    fonts.reset();
+    backend.reset();
+    if (keymap) xkb_keymap_unref(keymap);
+    if (xkb_ctx) xkb_context_unref(xkb_ctx);
     if (display) XCloseDisplay(display);
+    if (signal_fd != -1) close(signal_fd);
+    if (inotify_fd != -1) close(inotify_fd);
+    if (timer_fd != -1) close(timer_fd);
 }
 
-auto DisplayContext::Create(std::string font, std::string_view layout) -> Result<std::unique_ptr<DisplayContext>> {
-    const LayoutDescription* ld{};
-    if (layout == LAYOUT_NAME_ISO105) ld = &ISO105;
-    else if (layout == LAYOUT_NAME_ANSI104) ld = &ANSI104;
-    else Unreachable("Invalid layout");
-
-    std::unique_ptr<DisplayContext> C{new DisplayContext(ld)};
-    C->font_name = std::move(font);
-    Try(C->InitDisplay());
-    Try(C->InitFonts());
+auto DisplayContext::Create(DisplayOptions opts) -> Result<std::unique_ptr<DisplayContext>> {
+    auto ld = FindLayout(opts.layout);
+    if (not ld) Unreachable("Invalid layout");
+
+    auto tracing = opts.stats or not opts.trace_path.empty();
+    std::unique_ptr<DisplayContext> C{new DisplayContext(ld, tracing)};
+    C->font_name = std::move(opts.font);
+    C->highlight = opts.highlight;
+    C->resize_delay = opts.resize_delay;
+    C->kb_path = std::move(opts.kb_path);
+    C->overlay = opts.overlay;
+    C->print_stats = opts.stats;
+    C->trace_path = std::move(opts.trace_path);
+
+    auto init = C->tracer.Begin("Init");
+    Try(C->InitDisplay(opts.backend));
+    if (C->highlight) Try(C->InitHighlighting());
+    if (opts.dead_keys) Try(C->InitCompose(std::move(opts.compose_path)));
+    Try(C->InitEventLoop());
+    Try(C->InitKeymap());
     C->InitCells();
+    init.End();
     return C;
 }
 
+auto DisplayContext::Report() const -> Result<> {
+    if (print_stats) tracer.PrintStats(stderr);
+    if (not trace_path.empty()) Try(tracer.WriteChromeTrace(trace_path));
+    return {};
+}
+
 void DisplayContext::InitCells() { // clang-format off
-    for (auto [cell, border, keycode, label] : vws::zip(
+    auto t = tracer.Begin("InitCells");
+    auto codes = layout->codes;
+    std::vector<xkb::KeyLevels> levels(codes.size());
+    cell_by_keycode.fill(-1);
+    for (auto [i, code] : codes | vws::enumerate) cell_by_keycode[code] = i16(i);
+    xkb::ResolveLevels(keymap, group, codes, levels);
+    for (auto [cell, border, keycode, label, key_levels] : vws::zip(
         cells,
         cell_borders,
-        layout->codes,
-        layout->labels
+        codes,
+        layout->labels,
+        levels
     )) {
         cell.label_char = label;
+        cell.label.content = std::u32string{label};
         cell.border = &border;
         cell.keycode_raw = keycode;
         cell.keycode.content = text::ToUTF32(std::to_string(keycode));
-        ResolveKeysym(cell.keysyms[0], keycode, 0);
-        ResolveKeysym(cell.keysyms[1], keycode, ShiftMask);
-        ResolveKeysym(cell.keysyms[2], keycode, Mod5Mask);
-        ResolveKeysym(cell.keysyms[3], keycode, ShiftMask | Mod5Mask);
-        ResolveKeysym(cell.keysyms[4], keycode, Mod3Mask);
-        ResolveKeysym(cell.keysyms[5], keycode, ShiftMask | Mod3Mask);
-        ResolveKeysym(cell.keysyms[6], keycode, Mod5Mask | Mod3Mask);
-        ResolveKeysym(cell.keysyms[7], keycode, Mod5Mask | Mod3Mask | ShiftMask);
+        ResolveCell(cell, key_levels);
     }
+
+    // Text that is regenerated every frame is formatted in place; make
+    // room for it up front so a change in length doesn’t allocate.
+    format_buffer.reserve(256);
+    menu_text.content.reserve(256);
+    overlay_text.content.reserve(64);
 } // clang-format on
 
-auto DisplayContext::InitDisplay() -> Result<> {
+auto DisplayContext::InitDisplay(BackendKind kind) -> Result<> {
+    auto t = tracer.Begin("XOpenDisplay");
     display = XOpenDisplay(nullptr);
     if (not display) return Error("Failed to open display");
+    t.End();
 
     // Set up error handler.
     XSetErrorHandler(HandleError);
 
+    // Create the window and the back buffer.
     screen = XDefaultScreen(display);
-    window = XCreateSimpleWindow(display, XRootWindow(display, screen), 0, 0, w_width, w_height, 0, 0, 0x2D'2A2E);
-    white = XWhitePixel(display, screen);
-    black = XBlackPixel(display, screen);
+    fonts = Try(FontCache::Create(display, screen, font_cache_size));
+
+    // Without fallback fonts, we can still draw everything the main font has.
+    auto fallback_timer = tracer.Begin("InitFallback");
+    if (auto f = FontFallback::Create(font_name)) fallback = std::move(*f);
+    else std::println(stderr, "{}", f.error());
+    fallback_timer.End();
+    switch (kind) {
+        case BackendKind::Xlib: backend = Try(XlibBackend::Create(display, screen, w_width, w_height)); break;
+        case BackendKind::XCB: backend = Try(XcbBackend::Create(display, screen, *fonts, w_width, w_height)); break;
+    }
 
-    XGetWindowAttributes(display, window, &attrs);
+    delete_window = backend->delete_window();
+    frame_width = w_width;
+    frame_height = w_height;
 
-    // Enable receiving of WM_DELETE_WINDOW.
-    delete_window = XInternAtom(display, "WM_DELETE_WINDOW", False);
-    XSetWMProtocols(display, window, &delete_window, 1);
+    // Get notified whenever the keymap or the active group changes.
+    int opcode{}, error_base{};
+    int major = XkbMajorVersion, minor = XkbMinorVersion;
+    if (not XkbQueryExtension(display, &opcode, &xkb_event_base, &error_base, &major, &minor))
+        return Error("X server does not support XKB");
 
-    // Allocate the GC.
-    XGCValues values{};
-    values.cap_style = CapRound;
-    values.join_style = JoinRound;
-    u64 value_mask = GCCapStyle | GCJoinStyle;
+    constexpr u32 map_events = XkbNewKeyboardNotifyMask | XkbMapNotifyMask;
+    XkbSelectEvents(display, XkbUseCoreKbd, map_events, map_events);
+    XkbSelectEventDetails(display, XkbUseCoreKbd, XkbStateNotify, XkbGroupStateMask, XkbGroupStateMask);
 
-    gc = XCreateGC(display, window, value_mask, &values);
-    if (not gc) return Error("Failed to create graphics context");
+    XkbStateRec state{};
+    if (XkbGetState(display, XkbUseCoreKbd, &state) == Success) group = state.group;
     return {};
 }
 
-auto DisplayContext::InitFonts() -> Result<> {
-    draw = XftDrawCreate(display, window, attrs.visual, attrs.colormap);
-    if (not draw) return Error("Failed to create XftDraw");
-    x_fgcolour = XColour(fgcolour);
-    x_grey = XColour(grey);
-    x_red = XColour(0xFF'6188);
-    XftColorAllocValue(display, attrs.visual, attrs.colormap, &x_fgcolour, &xft_fgcolour);
-    XftColorAllocValue(display, attrs.visual, attrs.colormap, &x_grey, &xft_grey);
-    XftColorAllocValue(display, attrs.visual, attrs.colormap, &x_red, &xft_red);
+auto DisplayContext::InitEventLoop() -> Result<> {
+    // Handle termination signals in the event loop rather than in a signal
+    // handler so we always get to close the display connection properly.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &signals, nullptr) != 0)
+        return Error("sigprocmask(): {}", std::strerror(errno));
+
+    signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (signal_fd == -1) return Error("signalfd(): {}", std::strerror(errno));
+
+    // One-shot timer used to coalesce redraws.
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1) return Error("timerfd_create(): {}", std::strerror(errno));
+
+    // Watch the directory rather than the .kb file itself, since many
+    // editors save by replacing the file.
+    if (not kb_path.empty()) {
+        auto path = std::filesystem::absolute(kb_path);
+        kb_name = path.filename().string();
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd == -1) return Error("inotify_init1(): {}", std::strerror(errno));
+        if (inotify_add_watch(inotify_fd, path.parent_path().c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+            return Error("Cannot watch '{}': {}", kb_path, std::strerror(errno));
+    }
+
     return {};
 }
 
-void DisplayContext::Redraw() {
-    XGetWindowAttributes(display, window, &attrs);
-    w_width = u32(attrs.width);
-    w_height = u32(attrs.height);
-    XSetLineAttributes(
+auto DisplayContext::InitKeymap() -> Result<> {
+    auto t = tracer.Begin("InitKeymap");
+    xkb_ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (not xkb_ctx) return Error("Failed to create XKB context");
+    if (not kb_path.empty()) return LoadKeymap();
+
+    auto conn = XGetXCBConnection(display);
+    auto ok = xkb_x11_setup_xkb_extension(
+        conn,
+        XKB_X11_MIN_MAJOR_XKB_VERSION,
+        XKB_X11_MIN_MINOR_XKB_VERSION,
+        XKB_X11_SETUP_XKB_EXTENSION_NO_FLAGS,
+        nullptr,
+        nullptr,
+        nullptr,
+        nullptr
+    );
+
+    if (not ok) return Error("Failed to set up the XKB extension");
+    xkb_device = xkb_x11_get_core_keyboard_device_id(conn);
+    if (xkb_device == -1) return Error("Failed to get the core keyboard device");
+    return LoadKeymap();
+}
+
+auto DisplayContext::LoadKeymap() -> Result<> {
+    auto t = tracer.Begin("LoadKeymap");
+    xkb_keymap* km{};
+    if (kb_path.empty()) {
+        km = xkb_x11_keymap_new_from_device(
+            xkb_ctx,
+            XGetXCBConnection(display),
+            xkb_device,
+            XKB_KEYMAP_COMPILE_NO_FLAGS
+        );
+
+        if (not km) return Error("Failed to get the keymap from the X server");
+    } else {
+        auto file = Try(kb::MappedFile::Open(kb_path));
+        auto parsed = Try(kb::ParsedLayout::Parse(file.contents(), kb_path));
+        km = Try(kb::CompileKeymap(xkb_ctx, parsed, std::filesystem::path(kb_path).stem().string()));
+    }
+
+    if (keymap) xkb_keymap_unref(keymap);
+    keymap = km;
+    return {};
+}
+
+auto DisplayContext::InitHighlighting() -> Result<> {
+    int event{}, error{};
+    if (not XQueryExtension(display, "XInputExtension", &xi_opcode, &event, &error))
+        return Error("X server does not support XInput; cannot highlight pressed keys");
+
+    // Before XInput 2.1, raw events are not sent while another client has
+    // grabbed the keyboard, so the release of a key that starts a grab (e.g.
+    // a shortcut of the window manager) would never arrive.
+    int major = 2, minor = 2;
+    if (XIQueryVersion(display, &major, &minor) != Success or major < 2 or (major == 2 and minor < 1))
+        return Error("X server does not support XInput 2.1; cannot highlight pressed keys");
+
+    // Raw events are only delivered to the root window.
+    std::array<unsigned char, XIMaskLen(XI_LASTEVENT)> mask{};
+    XISetMask(mask.data(), XI_RawKeyPress);
+    XISetMask(mask.data(), XI_RawKeyRelease);
+    XIEventMask event_mask{
+        .deviceid = XIAllMasterDevices,
+        .mask_len = int(mask.size()),
+        .mask = mask.data(),
+    };
+    XISelectEvents(display, XRootWindow(display, screen), &event_mask, 1);
+
+    // The active level depends on the effective modifiers.
+    XkbSelectEventDetails(
         display,
-        gc,
-        u32(base_line_width * double(w_width) / double(base_width)),
-        LineSolid,
-        CapRound,
-        JoinRound
+        XkbUseCoreKbd,
+        XkbStateNotify,
+        XkbGroupStateMask | XkbModifierStateMask,
+        XkbGroupStateMask | XkbModifierStateMask
     );
 
-    font_sz = RelativeToWidth(.015);
-    font = Font(font_name, font_sz);
+    XkbStateRec state{};
+    if (XkbGetState(display, XkbUseCoreKbd, &state) == Success) active_level = LevelFromMods(state.mods);
+    return {};
+}
+
+auto DisplayContext::InitCompose(std::string path) -> Result<> {
+    auto t = tracer.Begin("LoadCompose");
+    if (path.empty()) path = Try(kb::DefaultComposeFile());
+
+    // The cache only saves time, so just parse the file if we can’t use it.
+    std::unique_ptr<kb::ComposeCache> cache;
+    if (auto dir = kb::DefaultCacheDir()) {
+        if (auto c = kb::ComposeCache::Create(*dir)) cache = std::move(*c);
+    }
+
+    if (cache) compose = Try(cache->Get(path));
+    else compose = Try(kb::ComposeTable::Load(path));
+    return {};
+}
+
+void DisplayContext::Present() {
+    backend->Present({.x = 0, .y = 0, .width = u16(frame_width), .height = u16(frame_height)});
+}
 
+void DisplayContext::Redraw() {
+    auto frame = tracer.Begin("Redraw");
+    auto first_request = XNextRequest(display);
+    ResizeFrame();
+    line_width = LineWidth(w_width);
+    backend->SetLineWidth(line_width);
+
+    font_sz = FontSize(w_width);
+    auto open = tracer.Begin("XftFontOpen");
+    fonts->BeginFrame();
+    font = fonts->Get(font_name, font_sz);
+    keycode_font = fonts->Get(font_name, KeycodeFontSize(font_sz));
+    keysym_font = fonts->Get(font_name, KeysymFontSize(font_sz));
+    open.End();
+    PrefetchFonts();
+
+    auto generate = tracer.Begin("GenerateKeyboard");
     GenerateKeyboard();
     GenerateMenuText();
-    XClearWindow(display, window);
+    GenerateOverlayText();
+    GeneratePreviewText();
+    generate.End();
+
+    auto shape = tracer.Begin("ShapeText");
+    ShapeText();
+    shape.End();
+
+    auto draw_cells = tracer.Begin("DrawCells");
     DrawCells();
+    DrawPreview();
+    Present();
+    draw_cells.End();
+
+    // Everything is up to date now.
+    damage.clear();
+    exposed.clear();
+    EndFrame(frame, first_request);
 }
 
-void DisplayContext::Run() {
-    // Display the window.
-    XMapWindow(display, window);
-    XSync(display, False);
+void DisplayContext::RedrawAreas(std::span<const XRectangle> areas) {
+    const auto Intersects = [](const XRectangle& a, const XRectangle& b) {
+        return a.x < b.x + b.width and b.x < a.x + a.width and a.y < b.y + b.height and b.y < a.y + a.height;
+    };
 
-    // Set a min size.
-    auto* hints = XAllocSizeHints();
-    hints->min_height = static_cast<int>(base_height / 2);
-    hints->min_width = static_cast<int>(base_width / 2);
-    hints->flags = PMinSize | PAspect;
-    hints->min_aspect = hints->max_aspect = {.x = base_width, .y = base_height};
-    XSetWMNormalHints(display, window, hints);
+    // Only shape and draw the cells that overlap the damage; clipping
+    // takes care of anything that extends past it.
+    damaged_cells.clear();
+    damaged_borders.clear();
+    for (auto [i, cell] : cells | vws::enumerate) {
+        auto area = CellArea(cell);
+        if (rgs::none_of(areas, [&](const XRectangle& a) { return Intersects(a, area); })) continue;
+        damaged_cells.push_back(usz(i));
+        damaged_borders.push_back(*cell.border);
+    }
 
-    // Set the window name.
-    XStoreName(display, window, "XKBDisplay");
+    auto t = tracer.Begin("RedrawAreas");
+    backend->Clip(areas);
+    backend->FillRectangles(Fill::Background, areas);
+    DrawPressedCells(damaged_cells);
+    backend->DrawBorders(damaged_borders);
+    ShapeText(damaged_cells);
+    DrawGlyphRuns();
+    DrawPreview();
+    backend->Clip({});
+}
 
-    // Set line params.
-    XSetForeground(display, gc, fgcolour);
-    XSetBackground(display, gc, bgcolour);
-    XSetFillStyle(display, gc, FillSolid);
-    XSetLineAttributes(display, gc, base_line_width, LineSolid, CapRound, JoinRound);
+void DisplayContext::RefreshKeys() {
+    if (stale_first > stale_last) return;
+    auto t = tracer.Begin("RefreshKeys");
 
-    // Subscribe to events.
-    XSelectInput(display, window, StructureNotifyMask);
+    // Fetch the new keymap once for the entire batch of changes. If that
+    // fails, we just keep showing the old one.
+    if (keymap_stale) {
+        keymap_stale = false;
+        if (auto res = LoadKeymap(); not res) std::println(stderr, "{}", res.error());
+    }
+
+    // Resolve all keys in the stale range in one go.
+    stale_cells.clear();
+    stale_codes.clear();
+    for (auto [i, cell] : cells | vws::enumerate) {
+        if (cell.keycode_raw < stale_first or cell.keycode_raw > stale_last) continue;
+        stale_cells.push_back(usz(i));
+        stale_codes.push_back(cell.keycode_raw);
+    }
+
+    stale_first = std::numeric_limits<u32>::max();
+    stale_last = 0;
+    resolved_levels.resize(stale_codes.size());
+    xkb::ResolveLevels(keymap, group, stale_codes, resolved_levels);
+
+    for (auto [i, levels] : vws::zip(stale_cells, resolved_levels))
+        if (ResolveCell(cells[i], levels)) DamageCell(i);
+}
+
+void DisplayContext::Resize(u32 width, u32 height) {
+    // The window has only been moved or restacked; whatever needs to be
+    // repainted in that case will be reported via Expose events.
+    if (width == w_width and height == w_height) return;
+    w_width = width;
+    w_height = height;
+    ScheduleRedraw();
+
+    // Show the last frame at the new size until then.
+    if (resize_delay != 0ms) MarkExposed({.x = 0, .y = 0, .width = u16(w_width), .height = u16(w_height)});
+}
+
+void DisplayContext::ResizeFrame() {
+    if (frame_width == w_width and frame_height == w_height) return;
+    backend->ResizeFrame(w_width, w_height);
+    frame_width = w_width;
+    frame_height = w_height;
+}
+
+auto DisplayContext::CheckAllocations() -> Result<> {
+    backend->Show(base_width, base_height);
+    Redraw();
+
+    // Pin the preview of the first dead key, if there is one, so that its
+    // panel is laid out and drawn every time as well.
+    for (auto [i, cell] : cells | vws::enumerate) {
+        auto dead = rgs::find_if(cell.dead_keys, [](xkb_keysym_t k) { return k != XKB_KEY_NoSymbol; });
+        if (dead == cell.dead_keys.end()) continue;
+        preview_pinned = true;
+        SetPreview(usz(i), *dead);
+        break;
+    }
+
+    if (compose and preview_lines == 0) std::println(stderr, "Note: the keymap has no dead keys to preview");
+
+    // Resize the window to a few sizes, and repaint all of it at each one
+    // as if it had been damaged. The first pass opens the fonts for these
+    // sizes and fills the glyph caches; after that, nothing may allocate.
+    const std::array<std::pair<u32, u32>, 3> sizes{{
+        {w_width, w_height},
+        {w_width * 3 / 4, w_height * 3 / 4},
+        {w_width * 5 / 4, w_height * 5 / 4},
+    }};
+
+    u64 allocations{};
+    for (int pass = 0; pass < 3; pass++) {
+        auto before = AllocationCount();
+        for (auto [width, height] : sizes) {
+            Resize(width, height);
+            Redraw();
+            Damage({.x = 0, .y = 0, .width = u16(width), .height = u16(height)});
+            Flush();
+        }
+        if (pass) allocations += AllocationCount() - before;
+    }
+
+    XSync(display, False);
+    if (allocations) return Error("Redrawing made {} heap allocations after the first frame", allocations);
+    return {};
+}
+
+void DisplayContext::Run() {
+    // Display the window.
+    auto show = tracer.Begin("MapWindow");
+    backend->Show(base_width, base_height);
+    show.End();
 
     // Initialise the window content.
     Redraw();
 
+    std::array<pollfd, 5> fds{{
+        {.fd = ConnectionNumber(display), .events = POLLIN, .revents = 0},
+        {.fd = signal_fd, .events = POLLIN, .revents = 0},
+        {.fd = timer_fd, .events = POLLIN, .revents = 0},
+        {.fd = fonts->notify_fd(), .events = POLLIN, .revents = 0},
+        {.fd = inotify_fd, .events = POLLIN, .revents = 0},
+    }};
+
     bool quit = false;
     while (not quit) {
+        // Process everything that is already queued up.
         while (XPending(display)) {
             XEvent e{};
             XNextEvent(display, &e);
+            if (e.type == xkb_event_base) {
+                HandleXkbEvent(e);
+                continue;
+            }
+
+            if (e.type == GenericEvent and e.xcookie.extension == xi_opcode) {
+                HandleRawKeyEvent(e);
+                continue;
+            }
+
             switch (e.type) {
                 default: continue;
-                case ConfigureNotify: Redraw(); break;
+                case ConfigureNotify: Resize(u32(e.xconfigure.width), u32(e.xconfigure.height)); break;
+                case FocusIn:
+                case FocusOut: MarkExposed({.x = 0, .y = 0, .width = u16(frame_width), .height = u16(frame_height)}); break;
+                case Expose:
+                    MarkExposed({
+                        .x = i16(e.xexpose.x),
+                        .y = i16(e.xexpose.y),
+                        .width = u16(e.xexpose.width),
+                        .height = u16(e.xexpose.height),
+                    });
+                    break;
+                case MappingNotify:
+                    if (e.xmapping.request != MappingKeyboard or not kb_path.empty()) break;
+                    keymap_stale = true;
+                    MarkStale(u32(e.xmapping.first_keycode), u32(e.xmapping.count));
+                    break;
                 case ClientMessage:
                     if (Atom(e.xclient.data.l[0]) == delete_window) quit = true;
                     break;
+                case MotionNotify: {
+                    if (not compose or preview_pinned) break;
+                    auto [cell, keysym] = DeadKeyAt(e.xmotion.x, e.xmotion.y);
+                    SetPreview(cell, keysym);
+                } break;
+                case LeaveNotify:
+                    if (not compose or preview_pinned) break;
+                    SetPreview(0, XKB_KEY_NoSymbol);
+                    break;
+                case ButtonPress:
+                    if (e.xbutton.button == Button1) HandleButtonPress(e.xbutton.x, e.xbutton.y);
+                    break;
             }
         }
 
-        std::this_thread::sleep_for(1'000'000us / FPS);
+        if (quit) break;
+
+        // Update the keys whose symbols have changed, if any, and repaint
+        // whatever is damaged or exposed right away. Nothing else sends
+        // the requests for that before we go to sleep, so flush them here.
+        RefreshKeys();
+        Flush();
+        backend->Flush();
+
+        // Sleep until the server, a signal, or the redraw timer wakes us up.
+        if (poll(fds.data(), fds.size(), -1) == -1) {
+            if (errno == EINTR) continue;
+            std::println(stderr, "poll(): {}", std::strerror(errno));
+            break;
+        }
+
+        if (fds[1].revents & POLLIN) {
+            signalfd_siginfo info{};
+            if (read(signal_fd, &info, sizeof info) == sizeof info) quit = true;
+        }
+
+        if (fds[2].revents & POLLIN) {
+            u64 expirations{};
+            if (read(timer_fd, &expirations, sizeof expirations) == sizeof expirations) {
+                redraw_scheduled = false;
+                Redraw();
+            }
+        }
+
+        if (fds[3].revents & POLLIN) fonts->ProcessMatches();
+        if (fds[4].revents & POLLIN) HandleFileEvents();
     }
 }
 
-// ============================================================================
-//  Character Handling
-// ============================================================================
-void DisplayContext::DrawCells() {
-    auto borders = cell_borders;
-    XDrawRectangles(display, window, gc, borders.data(), int(borders.size()));
-    for (const auto& cell : cells) {
-        DrawTextElem(cell.label, &xft_grey);
-        DrawTextElem(cell.keycode, &xft_grey, Font(font_name, font_sz / 2));
-        DrawTextElems(cell.keysyms, &xft_fgcolour, Font(font_name, u32(font_sz / 1.33)));
+void DisplayContext::HandleButtonPress(int x, int y) {
+    if (not compose) return;
+
+    // Clicking a dead key keeps its preview up until the next click;
+    // clicking it again or anywhere else dismisses it.
+    auto [cell, keysym] = DeadKeyAt(x, y);
+    if (keysym == XKB_KEY_NoSymbol or (preview_pinned and keysym == preview_keysym)) {
+        preview_pinned = false;
+        SetPreview(cell, keysym);
+        return;
     }
-    DrawTextElems(menu_text, &xft_fgcolour);
+
+    preview_pinned = true;
+    SetPreview(cell, keysym);
 }
 
-void DisplayContext::GenerateKeyboard() {
-    const u16 cell_size = u16(RelativeToWidth(.0625));
-    const u16 gap = u16(RelativeToWidth(.0125));
-    const u16 top_offset = u16(RelativeToWidth(.05));
-    const u16 right_margin = u16(w_width - cell_size);
+void DisplayContext::HandleFileEvents() {
+    alignas(inotify_event) std::array<char, 4'096> buffer;
+    bool changed = false;
+    for (;;) {
+        auto n = read(inotify_fd, buffer.data(), buffer.size());
+        if (n <= 0) break;
+        for (isz offs = 0; offs < n;) {
+            auto e = reinterpret_cast<const inotify_event*>(buffer.data() + offs);
+            if (e->len and std::string_view{e->name} == kb_name) changed = true;
+            offs += isz(sizeof(inotify_event) + e->len);
+        }
+    }
 
-    // Figure out where to place the cells and set up the borders around them.
-    for (usz cell_index = 0, row = 0; row < layout->rows.size(); row++) { // clang-format off
-        for (
-            u16 x = u16(gap + row * 2 * gap), i = 0;
-            x < right_margin and i < layout->rows[row];
-            x += cell_size + gap, i++
-        ) *cells[cell_index++].border = {
-            .x = i16(x),
-            .y = i16((row + 1) * gap + row * cell_size + top_offset),
-            .width = cell_size,
-            .height = cell_size,
-        };
-    } // clang-format on
+    // Recompile the keymap the next time we refresh the keys; only the cells
+    // whose symbols have actually changed are redrawn.
+    if (not changed) return;
+    keymap_stale = true;
+    MarkStale(0, 256);
+}
 
-    // Set up the cell labels, keycodes, and keysyms
-    for (usz cell_index = 0, i = 0; i < layout->num_keys(); i++) {
-        auto& cell = cells[cell_index++];
-        auto* rect = cell.border;
+void DisplayContext::HandleRawKeyEvent(XEvent& e) {
+    if (not XGetEventData(display, &e.xcookie)) return;
+    auto raw = static_cast<XIRawEvent*>(e.xcookie.data);
+    auto pressed = e.xcookie.evtype == XI_RawKeyPress;
+    auto code = raw->detail;
+    XFreeEventData(display, &e.xcookie);
+
+    // Key repeat sends more presses; only redraw if something changed.
+    if (code < 0 or code >= int(cell_by_keycode.size()) or cell_by_keycode[usz(code)] < 0) return;
+    auto index = usz(cell_by_keycode[usz(code)]);
+    if (cells[index].pressed == pressed) return;
+    cells[index].pressed = pressed;
+    DamageCell(index);
+}
+
+void DisplayContext::HandleXkbEvent(XEvent& e) {
+    auto& xkb = reinterpret_cast<XkbEvent&>(e);
+    switch (xkb.any.xkb_type) {
+        default: break;
+
+        // A different keyboard, possibly with different keycodes.
+        case XkbNewKeyboardNotify:
+            // We won’t see the releases of keys held down on the old keyboard.
+            for (usz i = 0; i < cells.size(); i++) {
+                if (not cells[i].pressed) continue;
+                cells[i].pressed = false;
+                DamageCell(i);
+            }
+
+            if (not kb_path.empty()) break;
+            keymap_stale = true;
+            MarkStale(0, 256);
+            break;
+
+        // Only re-resolve the keys whose symbols have changed, unless
+        // the key types have changed, in which case any key may be affected.
+        case XkbMapNotify:
+            if (not kb_path.empty()) break;
+            keymap_stale = true;
+            if (xkb.map.changed & XkbKeyTypesMask) MarkStale(0, 256);
+            else if (xkb.map.changed & XkbKeySymsMask) MarkStale(u32(xkb.map.first_key_sym), u32(xkb.map.num_key_syms));
+            break;
+
+        // The user has switched to a different layout.
+        case XkbStateNotify:
+            if (highlight and xkb.state.changed & XkbModifierStateMask) {
+                auto level = LevelFromMods(xkb.state.mods);
+                if (level != active_level) {
+                    active_level = level;
+                    for (usz i = 0; i < cells.size(); i++) DamageCell(i);
+                }
+            }
+
+            if (u32(xkb.state.group) == group) break;
+            group = u32(xkb.state.group);
+            MarkStale(0, 256);
+            break;
+    }
+}
+
+void DisplayContext::Damage(const XRectangle& area) {
+    const auto Contains = [](const XRectangle& outer, const XRectangle& inner) {
+        return outer.x <= inner.x and outer.y <= inner.y and
+               outer.x + outer.width >= inner.x + inner.width and
+               outer.y + outer.height >= inner.y + inner.height;
+    };
+
+    if (rgs::any_of(damage, [&](const XRectangle& d) { return Contains(d, area); })) return;
+    std::erase_if(damage, [&](const XRectangle& d) { return Contains(area, d); });
+    damage.push_back(area);
+}
+
+void DisplayContext::DamageCell(usz index) {
+    Damage(CellArea(cells[index]));
+}
+
+void DisplayContext::MarkExposed(const XRectangle& area) {
+    exposed.push_back(area);
+}
+
+void DisplayContext::Flush() {
+    // While the window is being resized, the frame still has the old size,
+    // so anything that changes is presented by scaling the entire frame.
+    auto scaling = resize_delay != 0ms and (frame_width != w_width or frame_height != w_height);
+
+    // Repaint the damaged parts of the frame; exposed areas don’t require
+    // any drawing since the frame still has their contents.
+    if (not damage.empty()) {
+        auto frame = tracer.Begin("Frame");
+        auto first_request = XNextRequest(display);
+        if (overlay) {
+            GenerateOverlayText();
+            Damage(overlay_area);
+        }
+
+        RedrawAreas(damage);
+        if (not scaling)
+            for (const auto& area : damage) backend->Present(area);
+        EndFrame(frame, first_request);
+    }
+
+    if (scaling) {
+        if (not damage.empty() or not exposed.empty()) {
+            auto t = tracer.Begin("PresentScaled");
+            backend->PresentScaled(frame_width, frame_height, w_width, w_height);
+        }
+    } else {
+        for (const auto& area : exposed) backend->Present(area);
+    }
+
+    damage.clear();
+    exposed.clear();
+}
+
+void DisplayContext::EndFrame(trace::Tracer::Scope& frame, u64 first_request) {
+    // The overlay shows these in the next frame; updating it right away
+    // would only cause another frame, ad infinitum.
+    last_frame_requests = XNextRequest(display) - first_request;
+    last_frame_time = frame.End();
+}
+
+void DisplayContext::MarkStale(u32 first_keycode, u32 count) {
+    if (count == 0) return;
+    stale_first = std::min(stale_first, first_keycode);
+    stale_last = std::max(stale_last, first_keycode + count - 1);
+}
+
+void DisplayContext::ScheduleRedraw() {
+    // Without a resize delay, wait for the rest of the frame so that a burst
+    // of events, e.g. from dragging the window edge, only results in a single
+    // redraw. Otherwise, restart the timer on every event so we only redraw
+    // once the window has stopped changing size.
+    constexpr auto frame = std::chrono::nanoseconds(1s) / FPS;
+    if (redraw_scheduled and resize_delay == 0ms) return;
+    redraw_scheduled = true;
+
+    auto delay = resize_delay == 0ms ? frame : std::chrono::nanoseconds(resize_delay);
+    auto secs = std::chrono::duration_cast<std::chrono::seconds>(delay);
+    itimerspec spec{};
+    spec.it_value.tv_sec = time_t(secs.count());
+    spec.it_value.tv_nsec = long((delay - secs).count());
+    timerfd_settime(timer_fd, 0, &spec, nullptr);
+}
+
+// ============================================================================
+//  Character Handling
+// ============================================================================
+void DisplayContext::DrawCells() {
+    XRectangle all{.x = 0, .y = 0, .width = u16(frame_width), .height = u16(frame_height)};
+    backend->FillRectangles(Fill::Background, {&all, 1});
+    pressed_borders.clear();
+    for (const auto& cell : cells)
+        if (cell.pressed) pressed_borders.push_back(*cell.border);
+    backend->FillRectangles(Fill::Pressed, pressed_borders);
+    backend->DrawBorders(cell_borders);
+    DrawGlyphRuns();
+}
+
+void DisplayContext::DrawPressedCells(std::span<const usz> which) {
+    pressed_borders.clear();
+    for (auto i : which)
+        if (cells[i].pressed) pressed_borders.push_back(*cells[i].border);
+    backend->FillRectangles(Fill::Pressed, pressed_borders);
+}
+
+void DisplayContext::DrawGlyphRuns() {
+    // Group the glyphs by font; positions are absolute, so the order
+    // doesn’t matter otherwise, and both backends have to start a new
+    // batch whenever the font changes.
+    for (auto [i, run] : glyph_runs | vws::enumerate) {
+        if (run.empty()) continue;
+        rgs::sort(run, std::less{}, &XftGlyphFontSpec::font);
+        backend->DrawGlyphs(Ink(i), run);
+    }
+}
+
+void DisplayContext::GenerateKeyboard() {
+    PlaceKeys(*layout, w_width, geometry);
+
+    // The size of the labels only depends on the font.
+    if (label_extents_font != font or label_extents_size != font_sz) {
+        label_extents_font = font;
+        label_extents_size = font_sz;
+        label_extents.clear();
+        for (const auto& cell : cells) label_extents.push_back(TextExtents(cell.label.content));
+    }
 
-        // Compute text extents.
-        std::u32string text{cell.label_char};
-        auto extents = TextExtents(text);
+    // Set up the cell labels, keycodes, and keysyms
+    for (auto [cell, key, extents] : vws::zip(cells, geometry, label_extents)) {
+        *cell.border = key.border;
+        for (auto [keysym, pos] : vws::zip(cell.keysyms, key.keysyms)) {
+            keysym.x = pos.x;
+            keysym.y = pos.y;
+        }
 
-        // Map extents relative to the cell position.
-        auto xpos = rect->x + rect->width / 2 - extents.width / 2;
-        auto ypos = rect->y + rect->height / 2 + extents.height / 2;
+        // Map text extents relative to the cell position.
+        auto [xpos, ypos] = LabelPosition(key.border, extents.width, extents.height);
         if (cell.label_char == U'Q') ypos -= font->descent / 2;
-        cell.label = {.x = xpos, .y = ypos, .content = text};
-        cell.keycode.x = xpos;
-        cell.keycode.y = int(cell.border->y) + int(font_sz) / 2 + 4;
+        cell.label.x = xpos;
+        cell.label.y = ypos;
 
-        // Er, this works, I’m not going to question how...
-        const auto vstride = int(.23 * rect->width);
-        const auto hstride = int(.25 * rect->height);
-        const int v_start = rect->x + int(.1 * rect->width);
-        cell.keysyms[0].x = cell.keysyms[1].x = v_start;
-        cell.keysyms[2].x = cell.keysyms[3].x = v_start + vstride;
-        cell.keysyms[4].x = cell.keysyms[5].x = v_start + vstride * 2;
-        cell.keysyms[6].x = cell.keysyms[7].x = v_start + vstride * 3;
-        cell.keysyms[0].y = cell.keysyms[2].y =
-            cell.keysyms[4].y = cell.keysyms[6].y = rect->y + rect->height - hstride;
-        cell.keysyms[1].y = cell.keysyms[3].y =
-            cell.keysyms[5].y = cell.keysyms[7].y = rect->y + hstride;
+        auto keycode = KeycodePosition(key.border, xpos, font_sz);
+        cell.keycode.x = keycode.x;
+        cell.keycode.y = keycode.y;
     }
 }
 
 void DisplayContext::GenerateMenuText() {
-    menu_text.clear();
-    auto text = std::format("Font: {} {}, Layout: {}", font_name, font_sz, layout->name);
-    DrawCentredTextAt(text::ToUTF32(text), int(w_width / 2u), HEIGHT_TIMES_TWO);
-}
-
-void DisplayContext::ResolveKeysym(Text& text, KeyCode code, u32 state) const {
-    std::array<char, 64> buf{};
-    KeySym sym;
-
-    // Synthesise an event as though the user had pressed the key in question,
-    // with the given modifiers, and ask X what symbol that key press produces.
-    XKeyPressedEvent ev;
-    ev.type = KeyPress;
-    ev.display = display;
-    ev.keycode = code;
-    ev.state = state;
-    auto size = XLookupString(&ev, buf.data(), buf.size(), &sym, nullptr);
-
-    if (sym == NoSymbol) text.content = U"";
-    else {
-        // I’m candidly not sure what in here is supposed to be able to throw,
-        // but I recall having to add that for some reason, so I’m not removing
-        // it now...
-        try {
-            text.content = text::ToUTF32(std::string_view{buf.data(), usz(size)});
-            text.diacritic = std::string_view(XKeysymToString(sym)).starts_with("dead") || IsDiacritic(text.content[0]);
-            if (text.diacritic) text.content = U"◌" + text.content;
-        } catch (...) {
-            text.content = U"";
-        }
+    format_buffer.clear();
+    std::format_to(std::back_inserter(format_buffer), "Font: {} {}, Layout: {}", font_name, font_sz, layout->name);
+    if (not kb_path.empty()) std::format_to(std::back_inserter(format_buffer), ", File: {}", kb_name);
+    AssignUTF32(menu_text.content, format_buffer);
+
+    // Centred horizontally, two lines from the top.
+    auto extents = TextExtents(menu_text.content);
+    menu_text.x = int(w_width / 2u) - extents.width / 2;
+    menu_text.y = extents.height * 2;
+}
+
+void DisplayContext::GenerateOverlayText() {
+    if (not overlay) return;
+
+    // Measure a template of the text instead of the text itself, so the
+    // area we damage doesn’t depend on the numbers.
+    auto ms = std::chrono::duration<double, std::milli>(last_frame_time).count();
+    format_buffer.clear();
+    std::format_to(std::back_inserter(format_buffer), "Frame: {:.2f} ms, {} requests", ms, last_frame_requests);
+    AssignUTF32(overlay_text.content, format_buffer);
+    auto extents = TextExtents(U"Frame: 000.00 ms, 00000 requests");
+    overlay_text.x = int(extents.height);
+    overlay_text.y = int(extents.height) * 2;
+
+    overlay_area = {
+        .x = i16(overlay_text.x),
+        .y = i16(overlay_text.y - font->ascent),
+        .width = u16(extents.width * 5 / 4),
+        .height = u16(font->ascent + font->descent),
+    };
+}
+
+auto DisplayContext::ResolveCell(Cell& cell, const xkb::KeyLevels& levels) -> bool {
+    bool changed = false;
+    for (auto [dead, sym] : vws::zip(cell.dead_keys, levels)) dead = sym.dead ? sym.keysym : XKB_KEY_NoSymbol;
+    for (auto [keysym, sym] : vws::zip(cell.keysyms, levels)) {
+        Text resolved{.content = xkb::DisplayText(sym), .diacritic = xkb::IsDiacritic(sym)};
+        if (resolved.content == keysym.content and resolved.diacritic == keysym.diacritic) continue;
+        keysym.content = std::move(resolved.content);
+        keysym.diacritic = resolved.diacritic;
+        changed = true;
     }
+    return changed;
 }
 
-auto DisplayContext::TextExtents(std::u32string_view t, XftFont* fnt) const -> XGlyphInfo {
+void DisplayContext::ShapeCell(const Cell& cell) {
+    ShapeTextElem(cell.label, Ink::Grey);
+    ShapeTextElem(cell.keycode, Ink::Grey, keycode_font);
+    for (auto [level, keysym] : cell.keysyms | vws::enumerate) {
+        auto ink = highlight and usz(level) == active_level ? Ink::Highlight : Ink::Foreground;
+        ShapeTextElem(keysym, ink, keysym_font);
+    }
+}
+
+void DisplayContext::ShapeText(std::span<const usz> which) {
+    for (auto& run : glyph_runs) run.clear();
+    for (auto i : which) ShapeCell(cells[i]);
+    ShapeTextElem(menu_text, Ink::Foreground);
+    ShapeTextElem(overlay_text, Ink::Grey);
+}
+
+void DisplayContext::ShapeText() {
+    for (auto& run : glyph_runs) run.clear();
+    for (const auto& cell : cells) ShapeCell(cell);
+    ShapeTextElem(menu_text, Ink::Foreground);
+    ShapeTextElem(overlay_text, Ink::Grey);
+}
+
+void DisplayContext::ShapeTextElem(const Text& elem, Ink ink, XftFont* fnt) {
+    if (elem.content.empty()) return;
     if (fnt == nullptr) fnt = font;
-    XGlyphInfo extents;
-    XftTextExtents32(
-        display,
-        fnt,
-        reinterpret_cast<const FcChar32*>(t.data()),
-        int(t.size()),
-        &extents
-    );
-    return extents;
+    if (elem.diacritic and ink != Ink::Highlight) ink = Ink::Red;
+    auto& glyphs = fonts->Glyphs(fnt);
+    auto& run = glyph_runs[usz(ink)];
+    int x = elem.x;
+    int y = elem.y;
+    for (auto c : elem.content) {
+        auto [f, g] = GlyphFor(c, fnt, glyphs);
+        run.push_back({.font = f, .glyph = g->index, .x = i16(x), .y = i16(y)});
+        x += g->extents.xOff;
+        y += g->extents.yOff;
+    }
+}
+
+auto DisplayContext::GlyphFor(char32_t c, XftFont* fnt, GlyphCache& glyphs) -> std::pair<XftFont*, const GlyphCache::Glyph*> {
+    if (auto face = fallback ? fallback->Find(c) : 0; face != 0) {
+        if (auto f = fonts->GetFace(fallback->face(face), fonts->size(fnt)))
+            return {f, &fonts->Glyphs(f).Get(c)};
+        fallback->MarkUnusable(face);
+    }
+
+    return {fnt, &glyphs.Get(c)};
+}
+
+auto DisplayContext::TextExtents(std::u32string_view t, XftFont* fnt) -> XGlyphInfo {
+    if (fnt == nullptr) fnt = font;
+    auto& glyphs = fonts->Glyphs(fnt);
+    return GlyphCache::Extents(t, [&](char32_t c) -> const GlyphCache::Glyph& { return *GlyphFor(c, fnt, glyphs).second; });
+}
+
+// ============================================================================
+//  Dead Key Preview
+// ============================================================================
+namespace {
+/// Get the text that stands for a keysym in a compose sequence.
+auto KeysymLabel(xkb_keysym_t keysym) -> std::u32string {
+    xkb::Symbol sym{.keysym = keysym, .codepoint = xkb::KeysymToUTF32(keysym), .dead = xkb::IsDeadKeysym(keysym)};
+
+    // Spaces and keysyms without a character are shown by name.
+    if (sym.codepoint > U' ' and sym.codepoint != U'\u00A0') return xkb::DisplayText(sym);
+    std::array<char, 64> name{};
+    if (xkb_keysym_get_name(keysym, name.data(), name.size()) < 0) return U"?";
+    return text::ToUTF32(name.data());
+}
+
+/// Get the text that stands for the result of a compose sequence.
+auto ResultLabel(const kb::ComposeResult& result) -> std::u32string {
+    if (result.text.empty()) return KeysymLabel(result.keysym);
+
+    // Draw a lone combining character on a dotted circle, like a key.
+    auto text = text::ToUTF32(result.text);
+    if (text.size() != 1) return text;
+    return xkb::DisplayText({.keysym = xkb_utf32_to_keysym(u32(text[0])), .codepoint = text[0], .dead = false});
+}
+} // namespace
+
+auto DisplayContext::DeadKeyAt(int x, int y) const -> std::pair<usz, xkb_keysym_t> {
+    // While the window is being resized, it shows the last frame scaled.
+    if (w_width and w_height) {
+        x = int(i64(x) * frame_width / w_width);
+        y = int(i64(y) * frame_height / w_height);
+    }
+
+    // Keep showing the preview while the pointer is over it.
+    const auto& p = preview_border;
+    if (preview_lines != 0 and x >= p.x and y >= p.y and x < p.x + p.width and y < p.y + p.height)
+        return {preview_cell, preview_keysym};
+
+    for (auto [i, cell] : cells | vws::enumerate) {
+        const auto& b = *cell.border;
+        if (x < b.x or y < b.y or x >= b.x + b.width or y >= b.y + b.height) continue;
+
+        // If there are several dead keys on the key, use the one that is
+        // drawn closest to the pointer.
+        xkb_keysym_t best = XKB_KEY_NoSymbol;
+        i64 best_distance = std::numeric_limits<i64>::max();
+        for (auto [dead, text] : vws::zip(cell.dead_keys, cell.keysyms)) {
+            if (dead == XKB_KEY_NoSymbol) continue;
+            auto dx = i64(x - text.x);
+            auto dy = i64(y - text.y);
+            if (dx * dx + dy * dy >= best_distance) continue;
+            best_distance = dx * dx + dy * dy;
+            best = dead;
+        }
+
+        return {usz(i), best};
+    }
+
+    return {0, XKB_KEY_NoSymbol};
+}
+
+void DisplayContext::DrawPreview() {
+    if (preview_lines == 0) return;
+    backend->FillRectangles(Fill::Background, {&preview_border, 1});
+    backend->DrawBorders({&preview_border, 1});
+    for (auto& run : glyph_runs) run.clear();
+    ShapeTextElem(preview_text.front(), Ink::Grey);
+    for (const auto& t : std::span{preview_text}.subspan(1, preview_lines - 1)) ShapeTextElem(t, Ink::Foreground, keysym_font);
+    DrawGlyphRuns();
+}
+
+void DisplayContext::CollectPreviewEntries() {
+    preview_entries.clear();
+    if (not compose or preview_keysym == XKB_KEY_NoSymbol) return;
+    auto node = compose->find(kb::ComposeTable::Root, preview_keysym);
+    if (not node) return;
+    compose->for_each_sequence(*node, [&](std::span<const xkb_keysym_t> suffix, const kb::ComposeResult& result) {
+        std::u32string entry;
+        for (auto keysym : suffix) {
+            entry += KeysymLabel(keysym);
+            entry += U' ';
+        }
+        entry += U"→ ";
+        entry += ResultLabel(result);
+        preview_entries.push_back(std::move(entry));
+    });
+}
+
+void DisplayContext::GeneratePreviewText() {
+    preview_border = {};
+    if (not compose or preview_keysym == XKB_KEY_NoSymbol) {
+        preview_lines = 0;
+        return;
+    }
+
+    // The panel covers the half of the keyboard that the key isn’t in.
+    auto keyboard = cell_borders.front();
+    for (const auto& b : cell_borders) {
+        auto right = std::max(keyboard.x + keyboard.width, b.x + b.width);
+        auto bottom = std::max(keyboard.y + keyboard.height, b.y + b.height);
+        keyboard.x = std::min(keyboard.x, b.x);
+        keyboard.y = std::min(keyboard.y, b.y);
+        keyboard.width = u16(right - keyboard.x);
+        keyboard.height = u16(bottom - keyboard.y);
+    }
+
+    const auto& key = *cells[preview_cell].border;
+    auto key_in_top_half = key.y + key.height / 2 < keyboard.y + keyboard.height / 2;
+    auto half = keyboard.height / 2;
+    auto top = key_in_top_half ? keyboard.y + keyboard.height - half : keyboard.y;
+
+    // Lay out the entries in as many columns as fit, and cut the list
+    // short if there are more than fit in the panel. The text elements
+    // are reused from the last layout, so this only allocates if the
+    // preview has changed since.
+    std::array<char, 64> name{};
+    xkb_keysym_get_name(preview_keysym, name.data(), name.size());
+    const auto& entries = preview_entries;
+    if (preview_text.empty()) preview_text.emplace_back();
+    auto& title = preview_text.front();
+    format_buffer.clear();
+    std::format_to(std::back_inserter(format_buffer), "{}: {} sequences", name.data(), entries.size());
+    AssignUTF32(title.content, format_buffer);
+    auto title_extents = TextExtents(title.content);
+    auto padding = int(title_extents.height);
+    auto line_height = int(keysym_font->ascent + keysym_font->descent);
+    auto column_width = 1;
+    for (const auto& e : entries) column_width = std::max(column_width, int(TextExtents(e, keysym_font).xOff) + padding);
+
+    auto columns = std::max(1, (keyboard.width - 2 * padding) / column_width);
+    auto max_rows = std::max(1, (half - 3 * padding - int(title_extents.height)) / line_height);
+    auto capacity = usz(columns * max_rows);
+    auto truncated = entries.size() > capacity;
+    auto shown = truncated ? capacity - 1 : entries.size();
+
+    preview_border = {
+        .x = keyboard.x,
+        .y = i16(top),
+        .width = keyboard.width,
+        .height = u16(half),
+    };
+
+    auto x = keyboard.x + padding;
+    auto y = top + padding + int(title_extents.height);
+    title.x = x;
+    title.y = y;
+
+    // Elements are never dropped, so that going back to a size at which
+    // more entries fit doesn’t allocate; adding some may invalidate 'title'.
+    preview_lines = 1 + shown + truncated;
+    if (preview_text.size() < preview_lines) preview_text.resize(preview_lines);
+    if (entries.empty()) return;
+    auto lines = std::span{preview_text}.first(preview_lines);
+    for (auto [t, e] : vws::zip(lines | vws::drop(1), entries)) t.content.assign(e);
+    if (truncated) {
+        format_buffer.clear();
+        std::format_to(std::back_inserter(format_buffer), "… {} more", entries.size() - shown);
+        AssignUTF32(lines.back().content, format_buffer);
+    }
+
+    auto rows = int((shown + truncated + usz(columns) - 1) / usz(columns));
+    for (auto [i, t] : lines | vws::drop(1) | vws::enumerate) {
+        t.x = x + int(i / rows) * column_width;
+        t.y = y + padding + (int(i % rows) + 1) * line_height - int(keysym_font->descent);
+    }
+}
+
+void DisplayContext::SetPreview(usz cell, xkb_keysym_t keysym) {
+    if (keysym == preview_keysym and (keysym == XKB_KEY_NoSymbol or cell == preview_cell)) return;
+    if (preview_lines != 0) Damage(BorderArea(preview_border));
+    preview_keysym = keysym;
+    preview_cell = cell;
+    CollectPreviewEntries();
+    GeneratePreviewText();
+    if (preview_lines != 0) Damage(BorderArea(preview_border));
+}
+
+// ============================================================================
+//  Glyph Cache
+// ============================================================================
+template <typename GetGlyph>
+auto GlyphCache::Extents(std::u32string_view text, GetGlyph get) -> XGlyphInfo {
+    // Same as what XftGlyphExtents() does for multiple glyphs: the ink
+    // rectangle is the union of that of all glyphs, and the advance is
+    // the sum of all advances.
+    int x = 0, y = 0;
+    int left = 0, right = 0, top = 0, bottom = 0;
+    for (auto [i, c] : text | vws::enumerate) {
+        auto& e = get(c).extents;
+        auto l = x - e.x;
+        auto t = y - e.y;
+        auto r = l + e.width;
+        auto b = t + e.height;
+        if (i == 0) {
+            left = l;
+            right = r;
+            top = t;
+            bottom = b;
+        } else {
+            left = std::min(left, l);
+            right = std::max(right, r);
+            top = std::min(top, t);
+            bottom = std::max(bottom, b);
+        }
+        x += e.xOff;
+        y += e.yOff;
+    }
+
+    return {
+        .width = u16(right - left),
+        .height = u16(bottom - top),
+        .x = i16(-left),
+        .y = i16(-top),
+        .xOff = i16(x),
+        .yOff = i16(y),
+    };
+}
+
+auto GlyphCache::Get(char32_t c) -> const Glyph& {
+    auto [it, inserted] = glyphs.try_emplace(c);
+    if (inserted) {
+        it->second.index = XftCharIndex(display, font, FcChar32(c));
+        XftGlyphExtents(display, font, &it->second.index, 1, &it->second.extents);
+    }
+    return it->second;
 }
 
 // ============================================================================
 //  Drawing
 // ============================================================================
-void DisplayContext::DrawCentredTextAt(const std::u32string& text, int xpos, int ypos) {
-    auto extents = TextExtents(text);
-    auto x = xpos - extents.width / 2;
-    auto y = ypos == HEIGHT_TIMES_TWO ? extents.height * 2 : ypos;
-    DrawTextAt(int(x), int(y), text);
+auto DisplayContext::BorderArea(const XRectangle& b) const -> XRectangle {
+    // Include the border, which is centred on the edge of the rectangle.
+    const auto lw = int(line_width);
+    return {
+        .x = i16(b.x - lw),
+        .y = i16(b.y - lw),
+        .width = u16(b.width + 2 * lw + 1),
+        .height = u16(b.height + 2 * lw + 1),
+    };
 }
 
-void DisplayContext::DrawTextAt(int x, int y, std::u32string text) {
-    menu_text.push_back({x, y, std::move(text)});
+auto DisplayContext::CellArea(const Cell& cell) const -> XRectangle {
+    return BorderArea(*cell.border);
 }
 
-void DisplayContext::DrawTextElems(const auto& text_elems, XftColor* colour, XftFont* fnt) const {
-    for (auto& text_elem : text_elems) DrawTextElem(text_elem, colour, fnt);
+void DisplayContext::PrefetchFonts() {
+    // Get the fonts we need if the window is resized a little bit ready
+    // in advance, including the fallback faces of characters we’ve seen;
+    // the cache never evicts the fonts that this frame uses to make room
+    // for them.
+    for (int delta : {-2, -1, 1, 2}) {
+        auto sz = u32(int(font_sz) + delta);
+        for (auto size : {sz, KeycodeFontSize(sz), KeysymFontSize(sz)}) {
+            fonts->Prefetch(font_name, size);
+            if (not fallback) continue;
+            for (auto face : fallback->used_faces()) fonts->PrefetchFace(fallback->face(face), size);
+        }
+    }
 }
 
-void DisplayContext::DrawTextElem(const Text& elem, const XftColor* colour, XftFont* fnt) const {
-    if (elem.content.empty()) return;
-    if (fnt == nullptr) fnt = font;
-    if (elem.diacritic) colour = &xft_red;
-    XftDrawString32(
-        draw,
-        colour,
-        fnt,
-        elem.x,
-        elem.y,
-        reinterpret_cast<const FcChar32*>(elem.content.data()),
-        int(elem.content.size())
+// ============================================================================
+//  Xlib Backend
+// ============================================================================
+XlibBackend::~XlibBackend() {
+    if (frame_picture) XRenderFreePicture(display, frame_picture);
+    if (window_picture) XRenderFreePicture(display, window_picture);
+    if (draw) XftDrawDestroy(draw);
+    if (frame) XFreePixmap(display, frame);
+    if (gc) XFreeGC(display, gc);
+    if (window) XDestroyWindow(display, window);
+}
+
+auto XlibBackend::Create(Display* display, int screen, u32 width, u32 height) -> Result<std::unique_ptr<XlibBackend>> {
+    std::unique_ptr<XlibBackend> B{new XlibBackend(display)};
+    B->window = XCreateSimpleWindow(display, XRootWindow(display, screen), 0, 0, width, height, 0, 0, BACKGROUND_COLOUR);
+    XGetWindowAttributes(display, B->window, &B->attrs);
+
+    // We paint every pixel of the window ourselves, so don’t let the server
+    // clear it to the background colour first; that only causes flicker.
+    XSetWindowBackgroundPixmap(display, B->window, None);
+
+    // Create the back buffer.
+    B->frame = XCreatePixmap(display, B->window, width, height, u32(B->attrs.depth));
+
+    // Enable receiving of WM_DELETE_WINDOW.
+    B->delete_window_atom = XInternAtom(display, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(display, B->window, &B->delete_window_atom, 1);
+
+    // Allocate the GC.
+    XGCValues values{};
+    values.cap_style = CapRound;
+    values.join_style = JoinRound;
+    values.graphics_exposures = False;
+    u64 value_mask = GCCapStyle | GCJoinStyle | GCGraphicsExposures;
+
+    B->gc = XCreateGC(display, B->window, value_mask, &values);
+    if (not B->gc) return Error("Failed to create graphics context");
+
+    B->draw = XftDrawCreate(display, B->frame, B->attrs.visual, B->attrs.colormap);
+    if (not B->draw) return Error("Failed to create XftDraw");
+
+    // Pictures used to scale the frame while the window is being resized.
+    B->format = XRenderFindVisualFormat(display, B->attrs.visual);
+    if (not B->format) return Error("Failed to find the XRender format of the window");
+    B->frame_picture = XRenderCreatePicture(display, B->frame, B->format, 0, nullptr);
+    B->window_picture = XRenderCreatePicture(display, B->window, B->format, 0, nullptr);
+
+    const auto Alloc = [&](u32 colour, XftColor& out) {
+        auto c = XColour(colour);
+        XftColorAllocValue(display, B->attrs.visual, B->attrs.colormap, &c, &out);
+    };
+
+    for (auto [i, c] : B->ink_colours | vws::enumerate) Alloc(InkColour(Ink(i)), c);
+    for (auto [i, c] : B->fill_colours | vws::enumerate) Alloc(FillColour(Fill(i)), c);
+    return B;
+}
+
+void XlibBackend::Clip(std::span<const XRectangle> areas) {
+    if (areas.empty()) {
+        XSetClipMask(display, gc, None);
+        XftDrawSetClip(draw, nullptr);
+        return;
+    }
+
+    XSetClipRectangles(display, gc, 0, 0, const_cast<XRectangle*>(areas.data()), int(areas.size()), Unsorted);
+    XftDrawSetClipRectangles(draw, 0, 0, areas.data(), int(areas.size()));
+}
+
+void XlibBackend::DrawBorders(std::span<const XRectangle> rects) {
+    XDrawRectangles(display, frame, gc, const_cast<XRectangle*>(rects.data()), int(rects.size()));
+}
+
+void XlibBackend::DrawGlyphs(Ink ink, std::span<const XftGlyphFontSpec> glyphs) {
+    XftDrawGlyphFontSpec(draw, &ink_colours[usz(ink)], glyphs.data(), int(glyphs.size()));
+}
+
+void XlibBackend::FillRectangles(Fill fill, std::span<const XRectangle> rects) {
+    for (const auto& r : rects) XftDrawRect(draw, &fill_colours[usz(fill)], r.x, r.y, r.width, r.height);
+}
+
+void XlibBackend::Flush() {
+    XFlush(display);
+}
+
+void XlibBackend::Present(const XRectangle& area) {
+    XCopyArea(display, frame, window, gc, area.x, area.y, area.width, area.height, area.x, area.y);
+}
+
+void XlibBackend::PresentScaled(u32 frame_width, u32 frame_height, u32 width, u32 height) {
+    // The transform maps window coordinates to frame coordinates.
+    XTransform transform{{
+        {XDoubleToFixed(double(frame_width) / width), 0, 0},
+        {0, XDoubleToFixed(double(frame_height) / height), 0},
+        {0, 0, XDoubleToFixed(1)},
+    }};
+
+    XRenderSetPictureTransform(display, frame_picture, &transform);
+    XRenderSetPictureFilter(display, frame_picture, FilterBilinear, nullptr, 0);
+    XRenderComposite(display, PictOpSrc, frame_picture, None, window_picture, 0, 0, 0, 0, 0, 0, width, height);
+}
+
+void XlibBackend::ResizeFrame(u32 width, u32 height) {
+    XRenderFreePicture(display, frame_picture);
+    XFreePixmap(display, frame);
+    frame = XCreatePixmap(display, window, width, height, u32(attrs.depth));
+    frame_picture = XRenderCreatePicture(display, frame, format, 0, nullptr);
+    XftDrawChange(draw, frame);
+}
+
+void XlibBackend::SetLineWidth(u32 width) {
+    XSetLineAttributes(display, gc, width, LineSolid, CapRound, JoinRound);
+}
+
+void XlibBackend::Show(u32 base_width, u32 base_height) {
+    XMapWindow(display, window);
+    XSync(display, False);
+
+    // Set a min size.
+    auto* hints = XAllocSizeHints();
+    hints->min_height = static_cast<int>(base_height / 2);
+    hints->min_width = static_cast<int>(base_width / 2);
+    hints->flags = PMinSize | PAspect;
+    hints->min_aspect = hints->max_aspect = {.x = int(base_width), .y = int(base_height)};
+    XSetWMNormalHints(display, window, hints);
+    XFree(hints);
+
+    // Set the window name.
+    XStoreName(display, window, "XKBDisplay");
+
+    // Set line params.
+    XSetForeground(display, gc, FOREGROUND_COLOUR);
+    XSetBackground(display, gc, BACKGROUND_COLOUR);
+    XSetFillStyle(display, gc, FillSolid);
+    XSetLineAttributes(display, gc, BASE_LINE_WIDTH, LineSolid, CapRound, JoinRound);
+
+    // Subscribe to events.
+    XSelectInput(
+        display,
+        window,
+        StructureNotifyMask | ExposureMask | FocusChangeMask | PointerMotionMask | ButtonPressMask | LeaveWindowMask
     );
 }
 
-auto DisplayContext::Font(const std::string& name, u32 font_sz) -> XftFont* {
-    std::pair pair = {name, font_sz};
-    if (font_cache.contains(pair)) return font_cache[pair];
-    auto f = font_cache[std::move(pair)] = XftFontOpen(
+// ============================================================================
+//  XCB Backend
+// ============================================================================
+XcbBackend::~XcbBackend() {
+    for (auto& [_, set] : glyph_sets) Free(set);
+    for (auto pic : ink_pictures)
+        if (pic) xcb_render_free_picture(conn, pic);
+    if (frame_picture) xcb_render_free_picture(conn, frame_picture);
+    if (window_picture) xcb_render_free_picture(conn, window_picture);
+    if (frame) xcb_free_pixmap(conn, frame);
+    if (gc) xcb_free_gc(conn, gc);
+    if (colour_gc) xcb_free_gc(conn, colour_gc);
+    if (window) xcb_destroy_window(conn, window);
+    xcb_flush(conn);
+}
+
+auto XcbBackend::Create(
+    Display* display,
+    int screen,
+    FontCache& fonts,
+    u32 width,
+    u32 height
+) -> Result<std::unique_ptr<XcbBackend>> {
+    auto conn = XGetXCBConnection(display);
+    std::unique_ptr<XcbBackend> B{new XcbBackend(conn)};
+    const auto InternAtom = [&](std::string_view name) {
+        return xcb_intern_atom(conn, 0, u16(name.size()), name.data());
+    };
+
+    // Send the queries whose replies we need first...
+    xcb_prefetch_extension_data(conn, &xcb_render_id);
+    auto protocols_cookie = InternAtom("WM_PROTOCOLS");
+    auto delete_window_cookie = InternAtom("WM_DELETE_WINDOW");
+
+    // ... then create everything that doesn’t depend on them.
+    auto roots = xcb_setup_roots_iterator(xcb_get_setup(conn));
+    for (int i = 0; i < screen; i++) xcb_screen_next(&roots);
+    auto s = roots.data;
+    B->depth = s->root_depth;
+
+    // We paint every pixel of the window ourselves, so don’t let the server
+    // clear it to the background colour first; that only causes flicker.
+    B->window = xcb_generate_id(conn);
+    std::array<u32, 2> window_values{
+        XCB_BACK_PIXMAP_NONE,
+        XCB_EVENT_MASK_STRUCTURE_NOTIFY | XCB_EVENT_MASK_EXPOSURE | XCB_EVENT_MASK_FOCUS_CHANGE |
+            XCB_EVENT_MASK_POINTER_MOTION | XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_LEAVE_WINDOW,
+    };
+
+    xcb_create_window(
+        conn,
+        XCB_COPY_FROM_PARENT,
+        B->window,
+        s->root,
+        0,
+        0,
+        u16(width),
+        u16(height),
+        0,
+        XCB_WINDOW_CLASS_INPUT_OUTPUT,
+        s->root_visual,
+        XCB_CW_BACK_PIXMAP | XCB_CW_EVENT_MASK,
+        window_values.data()
+    );
+
+    B->frame = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, B->depth, B->frame, B->window, u16(width), u16(height));
+
+    B->gc = xcb_generate_id(conn);
+    std::array<u32, 6> gc_values{
+        FOREGROUND_COLOUR,
+        BACKGROUND_COLOUR,
+        BASE_LINE_WIDTH,
+        XCB_CAP_STYLE_ROUND,
+        XCB_JOIN_STYLE_ROUND,
+        0,
+    };
+
+    xcb_create_gc(
+        conn,
+        B->gc,
+        B->frame,
+        XCB_GC_FOREGROUND | XCB_GC_BACKGROUND | XCB_GC_LINE_WIDTH | XCB_GC_CAP_STYLE | XCB_GC_JOIN_STYLE | XCB_GC_GRAPHICS_EXPOSURES,
+        gc_values.data()
+    );
+
+    // Sending XRender requests requires the extension’s opcode, so this is
+    // the first time we wait for the server.
+    auto render = xcb_get_extension_data(conn, &xcb_render_id);
+    if (not render or not render->present) return Error("X server does not support XRender");
+    auto version_cookie = xcb_render_query_version(conn, 0, 10);
+    auto formats_cookie = xcb_render_query_pict_formats(conn);
+
+    // And this is the second and last time.
+    XcbReply<xcb_intern_atom_reply_t> protocols{xcb_intern_atom_reply(conn, protocols_cookie, nullptr)};
+    XcbReply<xcb_intern_atom_reply_t> delete_window{xcb_intern_atom_reply(conn, delete_window_cookie, nullptr)};
+    XcbReply<xcb_render_query_version_reply_t> version{xcb_render_query_version_reply(conn, version_cookie, nullptr)};
+    XcbReply<xcb_render_query_pict_formats_reply_t> formats{xcb_render_query_pict_formats_reply(conn, formats_cookie, nullptr)};
+    if (not protocols or not delete_window) return Error("Failed to intern atoms");
+    if (not version or (version->major_version == 0 and version->minor_version < 10))
+        return Error("X server does not support XRender 0.10");
+    if (not formats) return Error("Failed to query XRender picture formats");
+    B->protocols_atom = protocols->atom;
+    B->delete_window_atom = delete_window->atom;
+
+    // Find the format of the window and the ones for glyphs.
+    for (auto si = xcb_render_query_pict_formats_screens_iterator(formats.get()); si.rem; xcb_render_pictscreen_next(&si))
+        for (auto di = xcb_render_pictscreen_depths_iterator(si.data); di.rem; xcb_render_pictdepth_next(&di))
+            for (auto vi = xcb_render_pictdepth_visuals_iterator(di.data); vi.rem; xcb_render_pictvisual_next(&vi))
+                if (vi.data->visual == s->root_visual) B->frame_format = vi.data->format;
+
+    for (auto fi = xcb_render_query_pict_formats_formats_iterator(formats.get()); fi.rem; xcb_render_pictforminfo_next(&fi)) {
+        const auto& f = *fi.data;
+        if (
+            f.type == XCB_RENDER_PICT_TYPE_DIRECT and
+            f.depth == 8 and
+            f.direct.alpha_mask == 0xFF and
+            f.direct.red_mask == 0 and
+            f.direct.green_mask == 0 and
+            f.direct.blue_mask == 0
+        ) B->a8_format = f.id;
+
+        // Without this format, colour glyphs are drawn like all others.
+        if (
+            f.type == XCB_RENDER_PICT_TYPE_DIRECT and
+            f.depth == 32 and
+            f.direct.alpha_shift == 24 and
+            f.direct.alpha_mask == 0xFF and
+            f.direct.red_shift == 16 and
+            f.direct.red_mask == 0xFF and
+            f.direct.green_shift == 8 and
+            f.direct.green_mask == 0xFF and
+            f.direct.blue_shift == 0 and
+            f.direct.blue_mask == 0xFF
+        ) B->argb32_format = f.id;
+    }
+
+    if (not B->frame_format or not B->a8_format) return Error("Failed to find XRender picture formats");
+
+    // Text is drawn by compositing a solid colour through the glyphs.
+    B->frame_picture = xcb_generate_id(conn);
+    B->window_picture = xcb_generate_id(conn);
+    xcb_render_create_picture(conn, B->frame_picture, B->frame, B->frame_format, 0, nullptr);
+    xcb_render_create_picture(conn, B->window_picture, B->window, B->frame_format, 0, nullptr);
+    for (auto [i, pic] : B->ink_pictures | vws::enumerate) {
+        pic = xcb_generate_id(conn);
+        xcb_render_create_solid_fill(conn, pic, RenderColour(InkColour(Ink(i))));
+    }
+
+    for (auto [i, c] : B->fill_colours | vws::enumerate) c = RenderColour(FillColour(Fill(i)));
+
+    // Glyph sets must go away along with their fonts, since another font
+    // may be opened at the same address.
+    fonts.on_close = [b = B.get()](XftFont* font) {
+        auto it = b->glyph_sets.find(font);
+        if (it == b->glyph_sets.end()) return;
+        b->Free(it->second);
+        b->glyph_sets.erase(it);
+    };
+
+    return B;
+}
+
+void XcbBackend::Clip(std::span<const XRectangle> areas) {
+    if (areas.empty()) {
+        u32 none = XCB_NONE;
+        xcb_change_gc(conn, gc, XCB_GC_CLIP_MASK, &none);
+        xcb_render_change_picture(conn, frame_picture, XCB_RENDER_CP_CLIP_MASK, &none);
+        return;
+    }
+
+    auto rects = Rects(areas);
+    xcb_set_clip_rectangles(conn, XCB_CLIP_ORDERING_UNSORTED, gc, 0, 0, u32(rects.size()), rects.data());
+    xcb_render_set_picture_clip_rectangles(conn, frame_picture, 0, 0, u32(rects.size()), rects.data());
+}
+
+void XcbBackend::DrawBorders(std::span<const XRectangle> rects) {
+    if (rects.empty()) return;
+    auto r = Rects(rects);
+    xcb_poly_rectangle(conn, frame, gc, u32(r.size()), r.data());
+}
+
+void XcbBackend::DrawGlyphs(Ink ink, std::span<const XftGlyphFontSpec> glyphs) {
+    // Header of an element of a CompositeGlyphs request, which is followed
+    // by the glyphs; a length of 255 means that it is followed by a glyph
+    // set to switch to instead.
+    struct Element {
+        u8 len;
+        std::array<u8, 3> pad;
+        i16 dx;
+        i16 dy;
+    };
+
+    static_assert(sizeof(Element) == 8);
+    const auto Append = [&](const auto& value) {
+        auto bytes = reinterpret_cast<const u8*>(&value);
+        glyph_commands.insert(glyph_commands.end(), bytes, bytes + sizeof value);
+    };
+
+    // Each glyph is positioned relative to the previous one, and we
+    // upload glyphs with no advance, so every glyph gets its own element.
+    // Requests are kept well below the maximum request size.
+    constexpr usz MaxRequestSize = 64 * 1024;
+    usz i = 0;
+    while (i < glyphs.size()) {
+        glyph_commands.clear();
+        xcb_render_glyphset_t first_set{}, set{};
+        int pen_x = 0, pen_y = 0;
+        for (; i < glyphs.size() and glyph_commands.size() < MaxRequestSize; i++) {
+            const auto& g = glyphs[i];
+            const auto& uploaded = Upload(g.font, g.glyph);
+
+            // Colour glyphs are drawn as they are, regardless of the ink;
+            // glyphs don’t overlap, so the order in which we draw them
+            // doesn’t matter.
+            if (auto it = uploaded.colour.find(g.glyph); it != uploaded.colour.end()) {
+                const auto& c = it->second;
+                xcb_render_composite(
+                    conn,
+                    XCB_RENDER_PICT_OP_OVER,
+                    c.picture,
+                    XCB_NONE,
+                    frame_picture,
+                    0,
+                    0,
+                    0,
+                    0,
+                    i16(g.x + c.left),
+                    i16(g.y - c.top),
+                    c.width,
+                    c.height
+                );
+                continue;
+            }
+
+            if (not first_set) first_set = set = uploaded.id;
+            else if (uploaded.id != set) {
+                set = uploaded.id;
+                Append(Element{.len = 0xFF, .pad = {}, .dx = 0, .dy = 0});
+                Append(u32(set));
+            }
+
+            Append(Element{.len = 1, .pad = {}, .dx = i16(g.x - pen_x), .dy = i16(g.y - pen_y)});
+            Append(u32(g.glyph));
+            pen_x = g.x;
+            pen_y = g.y;
+        }
+
+        if (glyph_commands.empty()) continue;
+        xcb_render_composite_glyphs_32(
+            conn,
+            XCB_RENDER_PICT_OP_OVER,
+            ink_pictures[usz(ink)],
+            frame_picture,
+            a8_format,
+            first_set,
+            0,
+            0,
+            u32(glyph_commands.size()),
+            glyph_commands.data()
+        );
+    }
+}
+
+void XcbBackend::FillRectangles(Fill fill, std::span<const XRectangle> rects) {
+    if (rects.empty()) return;
+    auto r = Rects(rects);
+    xcb_render_fill_rectangles(conn, XCB_RENDER_PICT_OP_SRC, frame_picture, fill_colours[usz(fill)], u32(r.size()), r.data());
+}
+
+void XcbBackend::Flush() {
+    xcb_flush(conn);
+}
+
+void XcbBackend::Free(const GlyphSet& set) {
+    xcb_render_free_glyph_set(conn, set.id);
+    for (const auto& [_, c] : set.colour) xcb_render_free_picture(conn, c.picture);
+}
+
+void XcbBackend::Present(const XRectangle& area) {
+    xcb_copy_area(conn, frame, window, gc, area.x, area.y, area.x, area.y, area.width, area.height);
+}
+
+void XcbBackend::PresentScaled(u32 frame_width, u32 frame_height, u32 width, u32 height) {
+    // The transform maps window coordinates to frame coordinates; the
+    // entries are 16.16 fixed-point numbers.
+    const auto Fixed = [](double d) { return xcb_render_fixed_t(d * 65'536); };
+    xcb_render_transform_t transform{
+        .matrix11 = Fixed(double(frame_width) / width),
+        .matrix12 = 0,
+        .matrix13 = 0,
+        .matrix21 = 0,
+        .matrix22 = Fixed(double(frame_height) / height),
+        .matrix23 = 0,
+        .matrix31 = 0,
+        .matrix32 = 0,
+        .matrix33 = Fixed(1),
+    };
+
+    // The frame picture is never used as a source otherwise, so we can
+    // leave the transform and filter in place.
+    constexpr std::string_view filter = "bilinear";
+    xcb_render_set_picture_transform(conn, frame_picture, transform);
+    xcb_render_set_picture_filter(conn, frame_picture, u16(filter.size()), filter.data(), 0, nullptr);
+    xcb_render_composite(conn, XCB_RENDER_PICT_OP_SRC, frame_picture, XCB_NONE, window_picture, 0, 0, 0, 0, 0, 0, u16(width), u16(height));
+}
+
+auto XcbBackend::Rects(std::span<const XRectangle> rects) -> std::span<const xcb_rectangle_t> {
+    rects_buffer.clear();
+    for (const auto& r : rects) rects_buffer.push_back({.x = r.x, .y = r.y, .width = r.width, .height = r.height});
+    return rects_buffer;
+}
+
+void XcbBackend::ResizeFrame(u32 width, u32 height) {
+    // The server is done with the old ids by the time it gets to the
+    // requests that reuse them.
+    xcb_render_free_picture(conn, frame_picture);
+    xcb_free_pixmap(conn, frame);
+    xcb_create_pixmap(conn, depth, frame, window, u16(width), u16(height));
+    xcb_render_create_picture(conn, frame_picture, frame, frame_format, 0, nullptr);
+}
+
+void XcbBackend::SetLineWidth(u32 width) {
+    xcb_change_gc(conn, gc, XCB_GC_LINE_WIDTH, &width);
+}
+
+void XcbBackend::Show(u32 base_width, u32 base_height) {
+    // WM_NORMAL_HINTS is a WM_SIZE_HINTS structure; see the ICCCM for the
+    // meaning of the fields. Set a min size and keep the aspect ratio.
+    std::array<u32, 18> hints{};
+    hints[0] = u32(PMinSize | PAspect);
+    hints[5] = base_width / 2;
+    hints[6] = base_height / 2;
+    hints[11] = hints[13] = base_width;
+    hints[12] = hints[14] = base_height;
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_NORMAL_HINTS, XCB_ATOM_WM_SIZE_HINTS, 32, u32(hints.size()), hints.data());
+
+    constexpr std::string_view name = "XKBDisplay";
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, window, XCB_ATOM_WM_NAME, XCB_ATOM_STRING, 8, u32(name.size()), name.data());
+
+    // Enable receiving of WM_DELETE_WINDOW.
+    xcb_change_property(conn, XCB_PROP_MODE_REPLACE, window, protocols_atom, XCB_ATOM_ATOM, 32, 1, &delete_window_atom);
+    xcb_map_window(conn, window);
+    xcb_flush(conn);
+}
+
+auto XcbBackend::Upload(XftFont* font, FT_UInt glyph) -> const GlyphSet& {
+    auto [it, inserted] = glyph_sets.try_emplace(font);
+    auto& set = it->second;
+    if (inserted) {
+        set.id = xcb_generate_id(conn);
+        xcb_render_create_glyph_set(conn, set.id, a8_format);
+    }
+
+    if (not set.uploaded.insert(glyph).second) return set;
+
+    // Render the glyph with FreeType; if that fails, upload an empty glyph
+    // since drawing a glyph that doesn’t exist is an error. Rendered bitmaps
+    // always have a positive pitch; rows of A8 images are padded to 4 bytes.
+    // Colour glyphs are kept as premultiplied BGRA, which is ARGB32.
+    xcb_render_glyphinfo_t info{};
+    auto colour = false;
+    bitmap.clear();
+    if (auto face = XftLockFace(font)) {
+        if (FT_Load_Glyph(face, glyph, FT_LOAD_RENDER | FT_LOAD_COLOR | FT_LOAD_TARGET_LIGHT) == 0) {
+            const auto& bm = face->glyph->bitmap;
+            colour = bm.pixel_mode == FT_PIXEL_MODE_BGRA and argb32_format;
+            auto channels = colour ? 4u : 1u;
+            auto stride = (bm.width * channels + 3) & ~3u;
+            bitmap.resize(usz(stride) * bm.rows);
+            for (u32 y = 0; y < bm.rows; y++) {
+                auto in = bm.buffer + usz(y) * usz(bm.pitch);
+                auto out = bitmap.data() + usz(y) * stride;
+                if (colour) {
+                    std::memcpy(out, in, usz(bm.width) * 4);
+                    continue;
+                }
+
+                for (u32 x = 0; x < bm.width; x++) {
+                    switch (bm.pixel_mode) {
+                        default: break;
+                        case FT_PIXEL_MODE_GRAY: out[x] = in[x]; break;
+                        case FT_PIXEL_MODE_MONO: out[x] = in[x / 8] & (0x80 >> (x % 8)) ? u8(0xFF) : u8(0); break;
+                        case FT_PIXEL_MODE_BGRA: out[x] = in[4 * x + 3]; break;
+                    }
+                }
+            }
+
+            // Colour fonts are often bitmap-only, in which case we get the
+            // nearest fixed strike, which is usually several times larger
+            // than the size we asked for; Xft scales those, so we do too.
+            auto scale = 1.0;
+            auto width = bm.width;
+            auto rows = bm.rows;
+            double pixel_size{};
+            if (
+                not FT_IS_SCALABLE(face) and
+                face->size->metrics.y_ppem != 0 and
+                FcPatternGetDouble(font->pattern, FC_PIXEL_SIZE, 0, &pixel_size) == FcResultMatch
+            ) scale = pixel_size / face->size->metrics.y_ppem;
+
+            if (scale != 1.0 and width and rows) {
+                width = std::max(1u, u32(std::lround(width * scale)));
+                rows = std::max(1u, u32(std::lround(rows * scale)));
+                ScaleImage(bitmap, bm.width, bm.rows, channels, scaled_bitmap, width, rows);
+                bitmap.swap(scaled_bitmap);
+            }
+
+            info = {
+                .width = u16(width),
+                .height = u16(rows),
+                .x = i16(-std::lround(face->glyph->bitmap_left * scale)),
+                .y = i16(std::lround(face->glyph->bitmap_top * scale)),
+                .x_off = 0,
+                .y_off = 0,
+            };
+        }
+
+        XftUnlockFace(font);
+    }
+
+    // Colour glyphs become pictures of their own. ARGB32 is BGRA in
+    // little-endian byte order, but the server wants its own byte order.
+    if (colour and info.width and info.height) {
+        if (xcb_get_setup(conn)->image_byte_order == XCB_IMAGE_ORDER_MSB_FIRST) {
+            for (usz i = 0; i + 4 <= bitmap.size(); i += 4) {
+                std::swap(bitmap[i], bitmap[i + 3]);
+                std::swap(bitmap[i + 1], bitmap[i + 2]);
+            }
+        }
+
+        auto pixmap = xcb_generate_id(conn);
+        xcb_create_pixmap(conn, 32, pixmap, window, info.width, info.height);
+        if (not colour_gc) {
+            colour_gc = xcb_generate_id(conn);
+            xcb_create_gc(conn, colour_gc, pixmap, 0, nullptr);
+        }
+
+        auto picture = xcb_generate_id(conn);
+        xcb_put_image(
+            conn,
+            XCB_IMAGE_FORMAT_Z_PIXMAP,
+            pixmap,
+            colour_gc,
+            info.width,
+            info.height,
+            0,
+            0,
+            0,
+            32,
+            u32(bitmap.size()),
+            bitmap.data()
+        );
+
+        xcb_render_create_picture(conn, picture, pixmap, argb32_format, 0, nullptr);
+        xcb_free_pixmap(conn, pixmap);
+        set.colour.emplace(
+            glyph,
+            ColourGlyph{
+                .picture = picture,
+                .left = i16(-info.x),
+                .top = info.y,
+                .width = info.width,
+                .height = info.height,
+            }
+        );
+        return set;
+    }
+
+    u32 id = glyph;
+    xcb_render_add_glyphs(conn, set.id, 1, &id, &info, u32(bitmap.size()), bitmap.data());
+    return set;
+}
+
+// ============================================================================
+//  Font Cache
+// ============================================================================
+FontCache::~FontCache() {
+    if (worker.joinable()) {
+        worker.request_stop();
+        worker.join();
+    }
+
+    for (auto& r : requests) FcPatternDestroy(r.pattern);
+    for (auto& m : matches)
+        if (m.pattern) FcPatternDestroy(m.pattern);
+    for (auto& e : entries) {
+        if (on_close) on_close(e.font);
+        XftFontClose(display, e.font);
+    }
+    if (event_fd != -1) close(event_fd);
+}
+
+auto FontCache::Create(Display* display, int screen, usz capacity) -> Result<std::unique_ptr<FontCache>> {
+    std::unique_ptr<FontCache> C{new FontCache(display, screen, capacity)};
+    C->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (C->event_fd == -1) return Error("eventfd(): {}", std::strerror(errno));
+    C->worker = std::jthread{[c = C.get()](std::stop_token stop) { c->Match(stop); }};
+    return C;
+}
+
+void FontCache::Evict() {
+    // Drop the least recently used fonts that the current frame doesn’t use.
+    auto it = entries.end();
+    while (entries.size() > capacity and it != entries.begin()) {
+        --it;
+        if (it->frame == frame) continue;
+        by_key.erase(it->key);
+        by_font.erase(it->font);
+        if (on_close) on_close(it->font);
+        XftFontClose(display, it->font);
+        it = entries.erase(it);
+    }
+}
+
+auto FontCache::Get(std::string_view name, u32 size) -> XftFont* {
+    if (auto it = by_key.find(KeyView{name, size}); it != by_key.end()) return Touch(it->second);
+
+    std::string family{name};
+    auto f = XftFontOpen(
         display,
         screen,
         XFT_FAMILY,
         XftTypeString,
-        name.data(),
+        family.c_str(),
         XFT_SIZE,
         XftTypeDouble,
-        double(font_sz),
+        double(size),
         nullptr
     );
 
     /// We’re not really equipped to deal with failure here...
-    Assert(f, "XftFontOpen(): Could not open {}:{}", name, font_sz);
-    return f;
+    Assert(f, "XftFontOpen(): Could not open {}:{}", name, size);
+    return Insert({std::move(family), size}, f, true);
+}
+
+auto FontCache::GetFace(const FontFace& face, u32 size) -> XftFont* {
+    if (auto it = by_key.find(KeyView{face.key, size}); it != by_key.end()) return Touch(it->second);
+
+    // Since we already know which file we want, there is nothing for
+    // fontconfig to match; it only has to apply the rendering settings.
+    auto pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FILE, reinterpret_cast<const FcChar8*>(face.file.c_str()));
+    FcPatternAddInteger(pattern, FC_INDEX, face.index);
+    FcPatternAddDouble(pattern, FC_SIZE, double(size));
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    XftDefaultSubstitute(display, screen, pattern);
+
+    // On success, the font takes ownership of the pattern.
+    auto f = XftFontOpenPattern(display, pattern);
+    if (not f) {
+        FcPatternDestroy(pattern);
+        return nullptr;
+    }
+
+    return Insert({face.key, size}, f, true);
+}
+
+auto FontCache::Glyphs(XftFont* font) -> GlyphCache& {
+    auto it = by_font.find(font);
+    Assert(it != by_font.end(), "Font is not in the cache");
+    return it->second->glyphs;
+}
+
+auto FontCache::Insert(Key key, XftFont* font, bool used) -> XftFont* {
+    entries.emplace_front(std::move(key), font, GlyphCache{display, font}, used ? frame : 0);
+    by_key.emplace(entries.front().key, entries.begin());
+    by_font.emplace(font, entries.begin());
+    Evict();
+    return font;
+}
+
+void FontCache::Match(std::stop_token stop) {
+    for (;;) {
+        std::unique_lock lock{mutex};
+        if (not requests_changed.wait(lock, stop, [&] { return not requests.empty(); })) return;
+        auto [key, pattern, file] = std::move(requests.front());
+        requests.pop_front();
+        lock.unlock();
+
+        // For a file, the pattern itself is what we open; the display
+        // defaults are applied on the main thread afterwards.
+        FcPattern* match{};
+        if (file) {
+            FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+            match = pattern;
+        } else {
+            FcResult res;
+            match = FcFontMatch(nullptr, pattern, &res);
+            FcPatternDestroy(pattern);
+        }
+
+        lock.lock();
+        matches.push_back({.key = std::move(key), .pattern = match, .file = file});
+        lock.unlock();
+        eventfd_write(event_fd, 1);
+    }
+}
+
+auto FontCache::size(XftFont* font) const -> u32 {
+    auto it = by_font.find(font);
+    Assert(it != by_font.end(), "Font is not in the cache");
+    return it->second->key.size;
+}
+
+auto FontCache::Touch(EntryList::iterator it) -> XftFont* {
+    entries.splice(entries.begin(), entries, it);
+    it->frame = frame;
+    return it->font;
+}
+
+void FontCache::Prefetch(std::string_view name, u32 size) {
+    if (size == 0 or by_key.contains(KeyView{name, size}) or in_flight.contains(KeyView{name, size})) return;
+    Key key{std::string{name}, size};
+
+    // This is what XftFontMatch() does, except that we do the actual
+    // matching on the worker. The substitutions need the display, so
+    // they have to happen here.
+    auto pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>(key.name.c_str()));
+    FcPatternAddDouble(pattern, FC_SIZE, double(size));
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    XftDefaultSubstitute(display, screen, pattern);
+    Enqueue(std::move(key), pattern, false);
+}
+
+void FontCache::PrefetchFace(const FontFace& face, u32 size) {
+    if (size == 0 or by_key.contains(KeyView{face.key, size}) or in_flight.contains(KeyView{face.key, size})) return;
+
+    // See GetFace(); the worker applies the configuration, which is what
+    // takes time here.
+    auto pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FILE, reinterpret_cast<const FcChar8*>(face.file.c_str()));
+    FcPatternAddInteger(pattern, FC_INDEX, face.index);
+    FcPatternAddDouble(pattern, FC_SIZE, double(size));
+    Enqueue({face.key, size}, pattern, true);
+}
+
+void FontCache::Enqueue(Key key, FcPattern* pattern, bool file) {
+    in_flight.insert(key);
+    std::unique_lock lock{mutex};
+    requests.push_back({.key = std::move(key), .pattern = pattern, .file = file});
+    requests_changed.notify_one();
+}
+
+void FontCache::ProcessMatches() {
+    eventfd_t count;
+    eventfd_read(event_fd, &count);
+
+    decltype(matches) done;
+    {
+        std::unique_lock lock{mutex};
+        done.swap(matches);
+    }
+
+    for (auto& [key, match, file] : done) {
+        in_flight.erase(key);
+        if (not match) continue;
+
+        // We may have had to open this synchronously in the meantime.
+        if (by_key.contains(key)) {
+            FcPatternDestroy(match);
+            continue;
+        }
+
+        // On success, the font takes ownership of the pattern.
+        if (file) XftDefaultSubstitute(display, screen, match);
+        auto f = XftFontOpenPattern(display, match);
+        if (not f) {
+            FcPatternDestroy(match);
+            continue;
+        }
+
+        // Nothing uses this yet, so it doesn’t count as used by this frame.
+        Insert(std::move(key), f, false);
+    }
+}
+
+// ============================================================================
+//  Font Fallback
+// ============================================================================
+// The cache file is 'magic, version, dependencies, faces', where each
+// dependency is 'mtime, path size, path' and each face is 'index, path size,
+// path, page count, pages, bitmaps'.
+constexpr std::string_view FontsMagic = "XKBFONTS";
+constexpr u32 FONTS_CACHE_VERSION = 1;
+
+namespace {
+auto ModificationTime(const std::filesystem::path& path) -> i64 {
+    std::error_code ec;
+    auto mtime = std::filesystem::last_write_time(path, ec);
+    return ec ? -1 : i64(mtime.time_since_epoch().count());
+}
+} // namespace
+
+auto FontFace::covers(char32_t c) const -> bool {
+    auto page = u32(c) >> 8;
+    auto it = rgs::lower_bound(pages, page);
+    if (it == pages.end() or *it != page) return false;
+    auto& bits = bitmaps[usz(it - pages.begin())];
+    return bits[(c & 0xFF) >> 5] >> (c & 31) & 1;
+}
+
+auto FontFallback::Build(std::string_view family) -> Result<> {
+    if (not FcInit()) return Error("Failed to initialise fontconfig");
+
+    // Same pattern as for XftFontOpen(), minus the size, which doesn’t
+    // affect coverage.
+    std::string name{family};
+    auto pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>(name.c_str()));
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+
+    // Trimming drops fonts that don’t have any characters that the fonts
+    // before them don’t also have.
+    FcResult res;
+    auto set = FcFontSort(nullptr, pattern, FcTrue, nullptr, &res);
+    FcPatternDestroy(pattern);
+    if (not set) return Error("Could not find any fonts for '{}'", family);
+
+    for (int i = 0; i < set->nfont and faces.size() < MaxFaces; i++) {
+        FcChar8* file{};
+        FcCharSet* charset{};
+        int index{};
+        if (FcPatternGetString(set->fonts[i], FC_FILE, 0, &file) != FcResultMatch) continue;
+        if (FcPatternGetCharSet(set->fonts[i], FC_CHARSET, 0, &charset) != FcResultMatch) continue;
+        FcPatternGetInteger(set->fonts[i], FC_INDEX, 0, &index);
+
+        auto& face = faces.emplace_back();
+        face.file = reinterpret_cast<const char*>(file);
+        face.index = index;
+        face.key = std::format("{}:{}", face.file, index);
+
+        std::array<FcChar32, FC_CHARSET_MAP_SIZE> map{};
+        FcChar32 next{};
+        for (
+            auto page = FcCharSetFirstPage(charset, map.data(), &next);
+            page != FC_CHARSET_DONE;
+            page = FcCharSetNextPage(charset, map.data(), &next)
+        ) {
+            face.pages.push_back(page >> 8);
+            face.bitmaps.push_back(std::bit_cast<std::array<u32, 8>>(map));
+        }
+
+        dependencies.emplace_back(face.file, ModificationTime(face.file));
+    }
+
+    FcFontSetDestroy(set);
+    if (faces.empty()) return Error("Could not find any fonts for '{}'", family);
+
+    // Installing or removing a font changes its directory, and any change
+    // to the configuration changes one of its files.
+    for (auto list : {FcConfigGetFontDirs(nullptr), FcConfigGetConfigFiles(nullptr)}) {
+        if (not list) continue;
+        while (auto path = FcStrListNext(list)) {
+            auto p = reinterpret_cast<const char*>(path);
+            dependencies.emplace_back(p, ModificationTime(p));
+        }
+        FcStrListDone(list);
+    }
+
+    return {};
+}
+
+auto FontFallback::Create(std::string_view family) -> Result<std::unique_ptr<FontFallback>> {
+    std::unique_ptr<FontFallback> F{new FontFallback()};
+    auto dir = kb::DefaultCacheDir();
+    auto path = dir ? *dir / "fonts" / std::format("{:016x}", kb::Hash(family)) : std::filesystem::path{};
+    if (dir and F->Load(path)) return F;
+    F->faces.clear();
+    F->dependencies.clear();
+    Try(F->Build(family));
+
+    // Failing to update the cache only means that we’ll do more work next time.
+    if (dir) {
+        std::error_code ec;
+        std::filesystem::create_directories(path.parent_path(), ec);
+        (void) F->Store(path);
+    }
+
+    return F;
+}
+
+auto FontFallback::Find(char32_t c) -> usz {
+    auto [it, inserted] = face_by_char.try_emplace(c, u16(0));
+    if (not inserted) return it->second;
+    for (auto [i, face] : faces | vws::enumerate) {
+        if (face.unusable or not face.covers(c)) continue;
+        it->second = u16(i);
+        break;
+    }
+
+    if (it->second != 0 and not rgs::contains(used, it->second)) used.push_back(it->second);
+    return it->second;
+}
+
+void FontFallback::MarkUnusable(usz index) {
+    faces[index].unusable = true;
+    std::erase_if(face_by_char, [&](const auto& entry) { return entry.second == index; });
+    std::erase(used, u16(index));
+}
+
+auto FontFallback::Load(const std::filesystem::path& path) -> bool {
+    auto file = kb::MappedFile::Open(path.string());
+    if (not file) return false;
+
+    // A damaged or outdated file is simply ignored; we’ll overwrite it afterwards.
+    auto in = file->contents();
+    const auto ReadString = [&](std::string& out) {
+        u32 size{};
+        if (not kb::Read(in, size) or in.size() < size) return false;
+        out = in.substr(0, size);
+        in.remove_prefix(size);
+        return true;
+    };
+
+    u32 version{}, count{};
+    if (not in.starts_with(FontsMagic)) return false;
+    in.remove_prefix(FontsMagic.size());
+    if (not kb::Read(in, version) or version != FONTS_CACHE_VERSION) return false;
+    if (not kb::Read(in, count)) return false;
+    for (u32 i = 0; i < count; i++) {
+        auto& [dep, mtime] = dependencies.emplace_back();
+        if (not kb::Read(in, mtime) or not ReadString(dep)) return false;
+        if (ModificationTime(dep) != mtime) return false;
+    }
+
+    if (not kb::Read(in, count) or count == 0) return false;
+    for (u32 i = 0; i < count; i++) {
+        auto& face = faces.emplace_back();
+        u32 pages{};
+        if (not kb::Read(in, face.index) or not ReadString(face.file) or not kb::Read(in, pages)) return false;
+        if (in.size() / (sizeof(u32) + sizeof(std::array<u32, 8>)) < pages) return false;
+        face.key = std::format("{}:{}", face.file, face.index);
+        face.pages.resize(pages);
+        face.bitmaps.resize(pages);
+        std::memcpy(face.pages.data(), in.data(), pages * sizeof(u32));
+        in.remove_prefix(pages * sizeof(u32));
+        std::memcpy(face.bitmaps.data(), in.data(), pages * sizeof(std::array<u32, 8>));
+        in.remove_prefix(pages * sizeof(std::array<u32, 8>));
+    }
+
+    return true;
+}
+
+auto FontFallback::Store(const std::filesystem::path& path) const -> Result<> {
+    std::string data;
+    const auto AppendString = [&](std::string_view str) {
+        kb::Append(data, u32(str.size()));
+        data += str;
+    };
+
+    data += FontsMagic;
+    kb::Append(data, FONTS_CACHE_VERSION);
+    kb::Append(data, u32(dependencies.size()));
+    for (const auto& [dep, mtime] : dependencies) {
+        kb::Append(data, mtime);
+        AppendString(dep);
+    }
+
+    kb::Append(data, u32(faces.size()));
+    for (const auto& face : faces) {
+        kb::Append(data, face.index);
+        AppendString(face.file);
+        kb::Append(data, u32(face.pages.size()));
+        data.append(reinterpret_cast<const char*>(face.pages.data()), face.pages.size() * sizeof(u32));
+        data.append(reinterpret_cast<const char*>(face.bitmaps.data()), face.bitmaps.size() * sizeof(std::array<u32, 8>));
+    }
+
+    return kb::WriteAtomically(path, data);
 }
 
 auto Main(int argc, char** argv) -> Result<int> {
@@ -474,13 +2979,43 @@ auto Main(int argc, char** argv) -> Result<int> {
     using options = clopts< // clang-format off
         positional<"layout", "The layout to use", values<LAYOUT_NAME_ISO105, LAYOUT_NAME_ANSI104>, false>,
         option<"-f", "The font to use">,
+        option<"--kb", "Show this .kb file instead of the keymap of the X server, and reload it when it changes">,
+        option<"--backend", "How to talk to the X server (default: xlib)", values<"xlib", "xcb">>,
+        option<"--resize-delay", "Milliseconds without resizing before the keyboard is laid out again (default: 150; 0 to disable)", std::int64_t>,
+        option<"--trace", "Write a Chrome trace of all phases to this file on exit">,
+        option<"--compose", "Compose file for --dead-keys (default: $XCOMPOSEFILE, ~/.XCompose, or that of the locale)">,
+        flag<"--check-allocations", "Redraw and resize a few times, and fail if that allocates after the first frame; implies --dead-keys">,
+        flag<"--dead-keys", "Show the compose sequences of a dead key when it is hovered or clicked">,
+        flag<"--highlight", "Highlight pressed keys and the symbols of the active level">,
+        flag<"--overlay", "Show the time and number of X requests of the last frame">,
+        flag<"--stats", "Print timing statistics for each phase on exit">,
         help<>
     >; // clang-format on
 
     auto opts = options::parse(argc, argv);
-    auto font = opts.get<"-f">("Charis SIL");
-    auto layout = opts.get<"layout">(std::getenv("XKBDISPLAY_DEFAULT_LAYOUT") ?: XKBDISPLAY_DEFAULT_LAYOUT);
-    auto ctx = Try(DisplayContext::Create(font, layout));
+    auto resize_delay = opts.get<"--resize-delay">(i64(150));
+    if (resize_delay < 0) return Error("Resize delay must not be negative");
+    auto ctx = Try(DisplayContext::Create({
+        .font = std::string{opts.get<"-f">("Charis SIL")},
+        .layout = opts.get<"layout">(std::getenv("XKBDISPLAY_DEFAULT_LAYOUT") ?: XKBDISPLAY_DEFAULT_LAYOUT),
+        .backend = opts.get<"--backend">("xlib") == "xcb" ? BackendKind::XCB : BackendKind::Xlib,
+        .kb_path = std::string{opts.get<"--kb">("")},
+        .highlight = opts.get<"--highlight">(),
+        .dead_keys = opts.get<"--dead-keys">() or opts.get<"--check-allocations">(),
+        .compose_path = std::string{opts.get<"--compose">("")},
+        .resize_delay = std::chrono::milliseconds(resize_delay),
+        .overlay = opts.get<"--overlay">(),
+        .stats = opts.get<"--stats">(),
+        .trace_path = std::string{opts.get<"--trace">("")},
+    }));
+
+    if (opts.get<"--check-allocations">()) {
+        Try(ctx->CheckAllocations());
+        std::println("Redrawing made no heap allocations after the first frame");
+        return 0;
+    }
+
     ctx->Run();
+    Try(ctx->Report());
     return 0;
 }
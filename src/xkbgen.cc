@@ -1,167 +1,481 @@
 #include <algorithm>
-#include <array>
+#include <atomic>
+#include <cerrno>
 #include <charconv>
+#include <chrono>
 #include <clopts.hh>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
 #include <print>
-#include <ranges>
+#include <thread>
+#include <unistd.h>
+#include <vector>
 
 #include <base/Base.hh>
-#include <base/Text.hh>
 
-#include <xkb++/layout.hh>
+#include <xkb++/cache.hh>
+#include <xkb++/compose.hh>
+#include <xkb++/kb.hh>
+#include <xkb++/keymap.hh>
 #include <xkb++/main.hh>
-#include <xkbcommon/xkbcommon.h>
+
+#ifndef XKBGEN_VERSION
+#    define XKBGEN_VERSION "unknown"
+#endif
 
 using namespace base;
-using namespace layout;
+using namespace kb;
+namespace fs = std::filesystem;
 
-constexpr usz LAYER_COUNT = 8;
+/// A single file to translate.
+struct Job {
+    std::string file;
+    std::string output;
+    std::string name;
+};
 
-// ============================================================================
-//  Layout Definition
-// ============================================================================
-class ParsedLayout {
-    struct Record {
-        std::u32string name;
-        std::vector<std::u32string> symbols;
-    };
+/// The result of running a job.
+struct Output {
+    std::string keymap;
+    usz input_size{};
 
-    std::vector<Record> records;
+    /// Whether this was loaded from the cache.
+    bool cached = false;
 
-public:
-    /// Write the layout to a file.
-    auto emit(FILE* out, std::string_view name) -> Result<>;
+    /// Whether the output file already has the right contents.
+    bool up_to_date = false;
+
+    /// Diagnostics and statistics from --verify.
+    std::string report;
+};
 
-    /// Parse a keyboard layout from a string.
-    static auto Parse(std::string_view text) -> Result<ParsedLayout>;
+/// Messages logged by libxkbcommon while verifying a keymap.
+struct CompileLog {
+    std::vector<std::pair<xkb_log_level, std::string>> messages;
 };
 
-// ============================================================================
-//  Helpers
-// ============================================================================
-auto KeySymName(std::u32string_view sym) -> std::string {
-    // Symbol is the empty symbol.
-    if (sym.empty()) return "NoSymbol";
+auto ParseJob(std::string_view spec) -> Result<Job> {
+    // The name comes last since it is the part most likely to contain a ':'.
+    auto first = spec.find(':');
+    auto second = first == std::string_view::npos ? first : spec.find(':', first + 1);
+    if (second == std::string_view::npos) return Error("Invalid job '{}'; expected 'file:output:name'", spec);
+    return Job{
+        .file = std::string{spec.substr(0, first)},
+        .output = std::string{spec.substr(first + 1, second - first - 1)},
+        .name = std::string{spec.substr(second + 1)},
+    };
+}
+
+auto ReadManifest(std::string_view path, std::vector<Job>& jobs) -> Result<> {
+    std::ifstream f{std::string{path}};
+    if (not f) return Error("Could not open manifest '{}'", path);
+
+    // Each line is 'file output name...'; the name extends to the end of the line.
+    std::string line;
+    for (usz line_no = 1; std::getline(f, line); line_no++) {
+        str s{line};
+        s.trim();
+        if (s.empty() or s.starts_with('#')) continue;
+        auto file = s.take_until_any(" \t");
+        s.trim_front();
+        auto output = s.take_until_any(" \t");
+        s.trim_front();
+        if (s.empty()) return Error("{}:{}: Expected 'file output name'", path, line_no);
+        jobs.emplace_back(std::string{file.text()}, std::string{output.text()}, std::string{s.text()});
+    }
+
+    return {};
+}
 
-    // Symbol is the name of a symbol.
-    if (sym.size() != 1) return text::ToUTF8(sym);
+auto CacheKey(const Job& job, std::string_view contents, const BuildCache& cache) -> u64 {
+    auto emitter = cache.emitter();
+    auto h = Hash(XKBGEN_VERSION);
+    h = Hash({reinterpret_cast<const char*>(&CACHE_FORMAT_VERSION), sizeof CACHE_FORMAT_VERSION}, h);
+    h = Hash({reinterpret_cast<const char*>(&emitter), sizeof emitter}, h);
+    h = Hash(job.name, h);
+    h = Hash("\0"sv, h);
+    return Hash(contents, h);
+}
 
-    // Symbol is a single keysym. It may have a name in XKB.
-    std::array<char, 1'024> buf;
-    auto x = xkb_utf32_to_keysym(sym.front());
-    auto sz = xkb_keysym_get_name(x, buf.data(), buf.size());
+/// Check whether an output file already contains exactly this keymap.
+auto IsUpToDate(const Job& job, std::string_view keymap) -> bool {
+    if (job.output == "-") return false;
+    auto existing = MappedFile::Open(job.output);
+    return existing and existing->contents() == keymap;
+}
 
-    // It does not.
-    if (sz == -1) return std::format("U{:04X}", usz(sym.front()));
+[[gnu::format(printf, 3, 0)]]
+void LogMessage(xkb_context* ctx, xkb_log_level level, const char* fmt, va_list args) {
+    auto log = static_cast<CompileLog*>(xkb_context_get_user_data(ctx));
+    va_list copy;
+    va_copy(copy, args);
+    auto size = std::vsnprintf(nullptr, 0, fmt, copy);
+    va_end(copy);
+    if (size <= 0) return;
 
-    // It does.
-    return std::string{buf.data(), usz(sz)};
+    std::string message(usz(size), '\0');
+    std::vsnprintf(message.data(), message.size() + 1, fmt, args);
+    while (message.ends_with('\n')) message.pop_back();
+    log->messages.emplace_back(level, std::move(message));
 }
 
-// ============================================================================
-//  Layout Implementation
-// ============================================================================
-auto ParsedLayout::emit(FILE* o, std::string_view kb_name) -> Result<> {
-    // Write header.
-    std::println(o, "default xkb_symbols \"basic\" {{");
-    std::println(o, "    name[Group1]=\"{}\";", kb_name);
-    std::println(o);
-    std::println(o, "    key.type[Group1] = \"EIGHT_LEVEL\";");
-
-    for (auto& [name, symbols] : records)  {
-        std::print(o, "    key <{}> {{ [", name);
-        bool first = true;
-        for (const auto& sym : symbols) {
-            if (first) first = false;
-            else std::print(o, ", ");
-            std::print(o, "{}", KeySymName(sym));
+/// Compile the keymap for a layout and report any problems in terms of
+/// the .kb file.
+auto Verify(const Job& job, std::string_view contents) -> Result<std::string> {
+    auto layout = Try(ParsedLayout::Parse(contents, job.file));
+    usz first_record_line{};
+    auto source = KeymapSource(layout, job.name, &first_record_line);
+
+    // Map a location in the keymap back to the record it came from.
+    const auto RecordLocation = [&](usz index) { return FormatLocation(job.file, contents, layout.record_offset(index)); };
+
+    const auto Describe = [&](std::string_view message) {
+        // Messages about the keymap source look like '... (input string):LINE:COL: message'.
+        static constexpr std::string_view Marker = "(input string):";
+        auto pos = message.find(Marker);
+        if (pos == std::string_view::npos) return std::format("{}: {}", job.file, message);
+
+        usz line{};
+        auto rest = message.substr(pos + Marker.size());
+        auto [ptr, ec] = std::from_chars(rest.data(), rest.data() + rest.size(), line);
+        if (ec != std::errc{}) return std::format("{}: {}", job.file, message);
+        rest.remove_prefix(usz(ptr - rest.data()));
+
+        // Drop the column; it refers to the generated line, not the .kb file.
+        if (rest.starts_with(':')) rest = rest.substr(std::min(rest.find_first_not_of("0123456789", 1), rest.size()));
+        if (rest.starts_with(':')) rest.remove_prefix(1);
+        rest = rest.substr(std::min(rest.find_first_not_of(' '), rest.size()));
+        if (line < first_record_line or line >= first_record_line + layout.size())
+            return std::format("{}: {} (in generated keymap, line {})", job.file, rest, line);
+        return std::format("{}: {}", RecordLocation(line - first_record_line), rest);
+    };
+
+    CompileLog log;
+    auto ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (not ctx) return Error("Failed to create XKB context");
+    xkb_context_set_user_data(ctx, &log);
+    xkb_context_set_log_fn(ctx, LogMessage);
+    xkb_context_set_log_level(ctx, XKB_LOG_LEVEL_WARNING);
+
+    auto start = std::chrono::steady_clock::now();
+    auto keymap = xkb_keymap_new_from_buffer(
+        ctx,
+        source.data(),
+        source.size(),
+        XKB_KEYMAP_FORMAT_TEXT_V1,
+        XKB_KEYMAP_COMPILE_NO_FLAGS
+    );
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    std::string report;
+    for (const auto& [level, message] : log.messages) {
+        auto kind = level <= XKB_LOG_LEVEL_ERROR ? "error" : "warning";
+        std::format_to(std::back_inserter(report), "{}: {}\n", kind, Describe(message));
+    }
+
+    if (not keymap) {
+        xkb_context_unref(ctx);
+        while (report.ends_with('\n')) report.pop_back();
+        return Error("{}: keymap failed to compile\n{}", job.file, report);
+    }
+
+    // Flag symbols that libxkbcommon silently dropped.
+    for (usz i = 0; i < layout.size(); i++) {
+        auto name = std::string{layout.record_name(i)};
+        auto key = xkb_keymap_key_by_name(keymap, name.c_str());
+        if (key == XKB_KEYCODE_INVALID) {
+            std::format_to(std::back_inserter(report), "warning: {}: Unknown key <{}>\n", RecordLocation(i), name);
+            continue;
         }
 
-        // Pad with empty symbol to level count.
-        for (usz i = symbols.size(); i < LAYER_COUNT; i++)
-            std::print(o, ", {}", KeySymName(U""));
+        for (usz group = 0; group < layout.group_count(i); group++) {
+            for (auto [level, id] : layout.record_symbols(i, group) | vws::enumerate) {
+                auto& sym = layout.symbol(id);
+                if (sym.text.empty()) continue;
+                const xkb_keysym_t* syms{};
+                auto count = xkb_keymap_key_get_syms_by_level(
+                    keymap,
+                    key,
+                    xkb_layout_index_t(group),
+                    xkb_level_index_t(level),
+                    &syms
+                );
 
-        std::println(o, "] }};");
+                if (count > 0 and syms[0] != XKB_KEY_NoSymbol) continue;
+                std::format_to(
+                    std::back_inserter(report),
+                    "warning: {}: '{}' on level {} of group {} of <{}> resolved to NoSymbol\n",
+                    RecordLocation(i),
+                    sym.text,
+                    level + 1,
+                    group + 1,
+                    name
+                );
+            }
+        }
     }
 
-    // Write modifier keys.
-    std::println(o);
-    std::println(o, "    key.type[Group1] = \"ONE_LEVEL\";");
-    std::println(o, "    key <RALT> {{ [ ISO_Level3_Shift ] }};");
-    std::println(o, "    key <RWIN> {{ [ ISO_Level5_Shift ] }};");
-    std::println(o, "    key <MENU> {{ [ ISO_Level5_Shift ] }};");
-    std::println(o);
-    std::println(o, "    include \"level3(ralt_switch)\"");
-    std::println(o, "    include \"level5(menu_switch)\"");
-    std::println(o, "}};");
+    auto serialised = xkb_keymap_get_as_string(keymap, XKB_KEYMAP_FORMAT_TEXT_V1);
+    auto keymap_size = serialised ? std::strlen(serialised) : 0;
+    std::free(serialised);
+    xkb_keymap_unref(keymap);
+    xkb_context_unref(ctx);
+
+    std::format_to(
+        std::back_inserter(report),
+        "{}: compiled in {:.2f} ms; source {} bytes, keymap {} bytes\n",
+        job.file,
+        elapsed,
+        source.size(),
+        keymap_size
+    );
+
+    return report;
+}
+
+auto Generate(const Job& job, std::string_view contents, const BuildCache* cache) -> Result<Output> {
+    Output out{.keymap = {}, .input_size = contents.size(), .cached = false, .up_to_date = false, .report = {}};
+    if (not cache) {
+        auto layout = Try(ParsedLayout::Parse(contents, job.file));
+        layout.emit(out.keymap, job.name);
+        return out;
+    }
+
+    // If we’ve seen this exact input before, we don’t need to parse it.
+    auto key = CacheKey(job, contents, *cache);
+    if (auto cached = cache->Load(key)) {
+        out.keymap = cached->contents();
+        out.up_to_date = IsUpToDate(job, out.keymap);
+        out.cached = true;
+        return out;
+    }
+
+    // Otherwise, reuse the lines of any records that haven’t changed since
+    // the last time we generated this output.
+    auto layout = Try(ParsedLayout::Parse(contents, job.file));
+    auto fragments_key = job.output == "-" ? fs::absolute(job.file).string() + ":" + job.name : fs::absolute(job.output).string();
+    auto old_fragments = cache->LoadFragments(fragments_key);
+    BuildCache::Fragments new_fragments;
+    layout.emit_header(out.keymap, job.name);
+    for (usz i = 0; i < layout.size(); i++) {
+        auto hash = layout.record_hash(i);
+        auto& fragment = new_fragments[hash];
+        if (fragment.empty()) {
+            if (auto it = old_fragments.find(hash); it != old_fragments.end()) fragment = std::move(it->second);
+            else layout.emit_record(fragment, i);
+        }
+        out.keymap += fragment;
+    }
+    layout.emit_footer(out.keymap);
+
+    // Failing to update the cache only means that we’ll do more work next time.
+    (void) cache->Store(key, out.keymap);
+    (void) cache->StoreFragments(fragments_key, new_fragments);
+    return out;
+}
+
+auto RunJob(const Job& job, const BuildCache* cache, bool verify) -> Result<Output> {
+    auto file = Try(MappedFile::Open(job.file));
+    auto out = Try(Generate(job, file.contents(), cache));
+    if (verify) out.report = Try(Verify(job, file.contents()));
+    return out;
+}
+
+auto WriteOutput(const Job& job, std::string_view keymap) -> Result<> {
+    auto stdout_ = job.output == "-";
+    auto fd = stdout_ ? STDOUT_FILENO : open(job.output.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return Error("Failed to open output file '{}': {}", job.output, std::strerror(errno));
+
+    // This is normally a single write(); only retry if it was cut short.
+    auto err = 0;
+    for (auto rest = keymap; not rest.empty();) {
+        auto n = write(fd, rest.data(), rest.size());
+        if (n < 0 and errno == EINTR) continue;
+        if (n < 0) {
+            err = errno;
+            break;
+        }
+        rest.remove_prefix(usz(n));
+    }
+
+    if (not stdout_) close(fd);
+    if (err) return Error("Failed to write output file '{}': {}", job.output, std::strerror(err));
     return {};
 }
 
-auto ParsedLayout::Parse(std::string_view text) -> Result<ParsedLayout> {
-    ParsedLayout layout;
-
-    // Remove comments.
-    auto converted = text::ToUTF32(text);
-    std::u32string text_no_comments;
-    for (auto l : str32{converted}.lines()) {
-        l = l.take_until([prev = char32_t(0)](char32_t c) mutable {
-            if (c == '#' and prev != '"' and prev != '\'') return true;
-            prev = c;
-            return false;
-        });
+/// Report every dead key of a layout that doesn’t start any compose
+/// sequence; returns the number of such keys.
+auto CheckDeadKeys(const ComposeTable& compose, const Job& job) -> Result<usz> {
+    auto file = Try(MappedFile::Open(job.file));
+    auto layout = Try(ParsedLayout::Parse(file.contents(), job.file));
+
+    // Remember the first record that uses each symbol so we can point to it.
+    std::vector<u32> first_use(layout.symbol_count(), ~0u);
+    for (usz i = layout.size(); i-- > 0;)
+        for (usz group = 0; group < layout.group_count(i); group++)
+            for (auto id : layout.record_symbols(i, group))
+                first_use[id] = u32(i);
+
+    usz missing = 0;
+    for (u32 id = 1; id < layout.symbol_count(); id++) {
+        if (first_use[id] == ~0u) continue;
+        auto name = std::string{layout.keysym_name(id)};
+        auto keysym = xkb_keysym_from_name(name.c_str(), XKB_KEYSYM_NO_FLAGS);
+        if (not xkb::IsDeadKeysym(keysym) or compose.find(ComposeTable::Root, keysym)) continue;
 
-        if (l.empty()) continue;
-        text_no_comments += l.trim().text();
-        text_no_comments += '\n';
+        auto record = first_use[id];
+        auto line = std::ranges::count(file.contents().substr(0, layout.record_offset(record)), '\n') + 1;
+        std::println(stderr, "{}:{}: {} on <{}> has no compose sequences", job.file, line, name, layout.record_name(record));
+        missing++;
     }
 
-    str32 s{text_no_comments};
-    while (not s.trim_front().empty()) {
-        if (not s.consume('<')) return Error("Expected '<' at start of key name");
+    return missing;
+}
 
-        // Read symbolic key name.
-        std::u32string name{s.take_until('>')};
-        if (not s.consume('>')) return Error("Expected '>' at end of key name");
+/// Check a compose file, and that it has sequences for the dead keys of
+/// every layout.
+auto CheckCompose(std::string_view path, std::span<const Job> jobs) -> Result<int> {
+    using Kind = ComposeDiagnostic::Kind;
+    auto start = std::chrono::steady_clock::now();
+    auto compose = Try(ComposeTable::Load(path));
+    auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 
-        // Read '=' and '['.
-        s.trim_front();
-        if (not s.consume('=')) return Error("Expected '=' after key index");
-        s.trim_front();
-        if (not s.consume('[')) return Error("Expected '[' before key symbols");
-        s.trim_front();
+    // Problems in the system compose files aren’t ours to fix, and
+    // overriding their sequences is the point of a user compose file, so
+    // only count those.
+    usz problems = 0;
+    usz overrides = 0;
+    usz in_includes = 0;
+    for (const auto& d : compose.diagnostics()) {
+        if (compose.included(d.location.file)) {
+            in_includes++;
+            continue;
+        }
+
+        if (d.kind == Kind::Override and d.previous and compose.included(d.previous->file)) {
+            overrides++;
+            continue;
+        }
 
-        // Read keys.
-        std::vector<std::u32string> symbol;
-        do {
-            str32 sym;
-            if (not s.take_delimited_any(sym, U"'\"")) sym = s.take_until_any(U" \r\n\t\v\f]");
-            symbol.emplace_back(str32{sym}.trim().text());
-            s.trim_front();
-        } while (not s.empty() and not s.starts_with(']'));
-        if (s.empty()) return Error("Expected ']' after key symbols");
-        s.drop();
-
-        layout.records.emplace_back(std::move(name), std::move(symbol));
+        std::println(stderr, "{}:{}: {}", compose.files()[d.location.file].path, d.location.line, d.message);
+        problems++;
     }
 
-    return layout;
+    for (const auto& job : jobs) problems += Try(CheckDeadKeys(compose, job));
+    std::println(
+        stderr,
+        "{}: {} sequences from {} files loaded in {:.2f} ms; {} problems, {} overrides of included sequences, {} problems in included files",
+        path,
+        compose.size(),
+        compose.files().size(),
+        elapsed,
+        problems,
+        overrides,
+        in_includes
+    );
+
+    return problems ? 1 : 0;
 }
 
 auto Main(int argc, char** argv) -> Result<int> {
     using namespace command_line_options;
-    using options = clopts<
-        positional<"file", "The file to translate to a keymap", file<std::string, std::string>>,
-        positional<"name", "The name of the kayout">,
+    using options = clopts< // clang-format off
+        positional<"file", "The file to translate to a keymap", std::string, false>,
+        positional<"name", "The name of the kayout", std::string, false>,
         option<"-o", "Output file name">,
-        help<>>;
+        multiple<option<"--job", "Translate 'file' to 'output' with 'name'; format: 'file:output:name'">>,
+        option<"--manifest", "File with one 'file output name' job per line">,
+        option<"-j", "The number of files to translate in parallel", std::int64_t>,
+        option<"--cache", "Directory in which to cache outputs between runs">,
+        flag<"--verify", "Compile each keymap and report problems and compile times">,
+        option<"--compose", "Instead of translating, check this .XCompose file and that it has sequences for every dead key in the given files">,
+        help<>
+    >; // clang-format on
 
     auto opts = options::parse(argc, argv);
-    auto file = opts.get<"file">();
-    auto output = opts.get<"-o">("-");
-    auto name = opts.get<"name">();
-    auto o = output == "-"sv ? stdout : fopen(output.data(), "w");
-    if (not o) return Error("Failed to open output file '{}'", output);
-    auto layout = Try(ParsedLayout::Parse(file->contents));
-    Try(layout.emit(o, *name));
-    return 0;
+    auto verify = opts.get<"--verify">();
+    auto threads = opts.get<"-j">(i64(std::max(std::thread::hardware_concurrency(), 1u)));
+    if (threads <= 0) return Error("Number of jobs must be positive");
+
+    // Collect jobs in the order they were specified; that is also the order
+    // in which outputs are written and errors reported.
+    auto compose = opts.get<"--compose">();
+    std::vector<Job> jobs;
+    if (auto file = opts.get<"file">()) {
+        // Checking a compose file only reads the layouts, so they need no name.
+        auto name = opts.get<"name">();
+        if (not name and not compose) return Error("Missing layout name for '{}'", *file);
+        jobs.emplace_back(*file, opts.get<"-o">("-"), name ? *name : "");
+    }
+
+    for (const auto& spec : opts.get<"--job">()) jobs.push_back(Try(ParseJob(spec)));
+    if (auto manifest = opts.get<"--manifest">()) Try(ReadManifest(*manifest, jobs));
+    if (compose) return CheckCompose(*compose, jobs);
+    if (jobs.empty()) return Error("Nothing to do; specify a file, --job, or --manifest");
+
+    std::unique_ptr<BuildCache> cache;
+    if (auto dir = opts.get<"--cache">()) cache = Try(BuildCache::Create(*dir));
+
+    // A single job is just the plain old single-file translation.
+    if (jobs.size() == 1) {
+        auto out = Try(RunJob(jobs.front(), cache.get(), verify));
+        std::print(stderr, "{}", out.report);
+        if (not out.up_to_date) Try(WriteOutput(jobs.front(), out.keymap));
+        return 0;
+    }
+
+    std::vector<Result<Output>> results(jobs.size());
+    std::atomic<usz> next = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> workers;
+        for (i64 i = 0; i < std::min(threads, i64(jobs.size())); i++) {
+            workers.emplace_back([&] {
+                for (;;) {
+                    auto j = next++;
+                    if (j >= jobs.size()) break;
+                    results[j] = RunJob(jobs[j], cache.get(), verify);
+                }
+            });
+        }
+    }
+
+    usz failed = 0;
+    usz bytes = 0;
+    usz cached = 0;
+    for (auto [job, res] : vws::zip(jobs, results)) {
+        auto written = res.and_then([&](const Output& out) -> Result<> {
+            if (out.up_to_date) return {};
+            return WriteOutput(job, out.keymap);
+        });
+
+        if (res) std::print(stderr, "{}", res->report);
+        if (written) {
+            bytes += res->input_size;
+            if (res->cached) cached++;
+            continue;
+        }
+
+        std::println(stderr, "{}", written.error());
+        failed++;
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::println(
+        stderr,
+        "Translated {} of {} files ({} cached) in {:.3f}s ({:.1f} files/s, {:.2f} MiB/s)",
+        jobs.size() - failed,
+        jobs.size(),
+        cached,
+        elapsed,
+        double(jobs.size()) / elapsed,
+        double(bytes) / (1024 * 1024) / elapsed
+    );
+
+    return failed ? 1 : 0;
 }
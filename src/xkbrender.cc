@@ -0,0 +1,580 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <clopts.hh>
+#include <filesystem>
+#include <fstream>
+#include <print>
+#include <ranges>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <base/Base.hh>
+#include <base/Text.hh>
+
+#include <fontconfig/fontconfig.h>
+#include <ft2build.h>
+#include <xkb++/kb.hh>
+#include <xkb++/keymap.hh>
+#include <xkb++/layout.hh>
+#include <xkb++/main.hh>
+#include <zlib.h>
+#include FT_FREETYPE_H
+
+using namespace base;
+using namespace layout;
+namespace fs = std::filesystem;
+
+// ============================================================================
+//  Data
+// ============================================================================
+enum class ImageFormat : u8 {
+    PNG,
+    PPM,
+};
+
+/// A font file, at the pixel size that corresponds to some point size.
+struct FontFile {
+    std::string path;
+    int index{};
+    u32 pixel_size{};
+};
+
+/// Everything that stays the same across all images we render.
+struct RenderConfig {
+    const LayoutDescription* layout{};
+    u32 width{};
+    u32 height{};
+    u32 font_size{};
+    FontFile label_font;
+    FontFile keycode_font;
+    FontFile keysym_font;
+    fs::path output_dir;
+    ImageFormat format{};
+};
+
+/// An RGB image in memory.
+class Canvas {
+    u32 w;
+    u32 h;
+    std::vector<u8> pixels;
+
+public:
+    Canvas(u32 width, u32 height, u32 colour);
+
+    /// Blend a colour into a pixel.
+    void Blend(int x, int y, u8 alpha, u32 colour);
+
+    /// Fill a rectangle.
+    void FillRect(int x, int y, int width, int height, u32 colour);
+
+    /// Draw the outline of a rectangle, centred on its edges like X does.
+    void StrokeRect(const XRectangle& r, u32 line_width, u32 colour);
+
+    /// Get the raw RGB data.
+    auto data() const -> std::span<const u8> { return pixels; }
+    auto height() const -> u32 { return h; }
+    auto width() const -> u32 { return w; }
+};
+
+/// A font face at a single size, with a cache of rendered glyphs.
+class Face {
+    struct Glyph {
+        int left{};
+        int top{};
+        int advance{};
+        u32 width{};
+        u32 rows{};
+        std::vector<u8> alpha;
+    };
+
+    FT_Face face{};
+    std::unordered_map<char32_t, Glyph> glyphs;
+
+    Face() = default;
+
+public:
+    Face(const Face&) = delete;
+    Face(Face&&) = delete;
+    Face& operator=(const Face&) = delete;
+    Face& operator=(Face&&) = delete;
+    ~Face();
+
+    /// Open a font.
+    static auto Open(FT_Library ft, const FontFile& file) -> Result<std::unique_ptr<Face>>;
+
+    /// Distance from the baseline to the bottom of the font.
+    auto descent() const -> int;
+
+    /// Draw text with its baseline at the given position.
+    void Draw(Canvas& canvas, std::u32string_view text, int x, int y, u32 colour);
+
+    /// Get the size of the ink rectangle of some text.
+    auto Extents(std::u32string_view text) -> std::pair<int, int>;
+
+private:
+    auto Get(char32_t c) -> const Glyph&;
+};
+
+/// Renders keymaps to images; each thread has its own renderer.
+class Renderer {
+    const RenderConfig& config;
+    FT_Library ft{};
+    xkb_context* ctx{};
+    std::unique_ptr<Face> label_face;
+    std::unique_ptr<Face> keycode_face;
+    std::unique_ptr<Face> keysym_face;
+    std::vector<KeyGeometry> geometry;
+    std::vector<xkb::KeyLevels> levels;
+
+    explicit Renderer(const RenderConfig& config)
+        : config{config},
+          geometry(config.layout->num_keys()),
+          levels(config.layout->num_keys()) {}
+
+public:
+    Renderer(const Renderer&) = delete;
+    Renderer(Renderer&&) = delete;
+    Renderer& operator=(const Renderer&) = delete;
+    Renderer& operator=(Renderer&&) = delete;
+    ~Renderer();
+
+    /// Create a new renderer.
+    static auto Create(const RenderConfig& config) -> Result<std::unique_ptr<Renderer>>;
+
+    /// Render a .kb file or keymap and return the path of the image.
+    auto Render(const fs::path& input) -> Result<fs::path>;
+
+private:
+    void Draw(Canvas& canvas, std::string_view title);
+    auto LoadKeymap(const fs::path& input) -> Result<xkb_keymap*>;
+};
+
+// ============================================================================
+//  Helpers
+// ============================================================================
+auto MatchFont(std::string_view family, u32 size, u32 dpi) -> Result<FontFile> {
+    std::string name{family};
+    auto pattern = FcPatternCreate();
+    FcPatternAddString(pattern, FC_FAMILY, reinterpret_cast<const FcChar8*>(name.c_str()));
+    FcPatternAddDouble(pattern, FC_SIZE, double(size));
+    FcPatternAddDouble(pattern, FC_DPI, double(dpi));
+    FcConfigSubstitute(nullptr, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+
+    FcResult res;
+    auto match = FcFontMatch(nullptr, pattern, &res);
+    FcPatternDestroy(pattern);
+    if (not match) return Error("No font matches '{}'", family);
+
+    FcChar8* path{};
+    int index{};
+    double pixel_size{};
+    if (FcPatternGetString(match, FC_FILE, 0, &path) != FcResultMatch) {
+        FcPatternDestroy(match);
+        return Error("Font matching '{}' is not a file", family);
+    }
+
+    FcPatternGetInteger(match, FC_INDEX, 0, &index);
+    if (FcPatternGetDouble(match, FC_PIXEL_SIZE, 0, &pixel_size) != FcResultMatch)
+        pixel_size = size * dpi / 72.0;
+
+    FontFile file{
+        .path = reinterpret_cast<const char*>(path),
+        .index = index,
+        .pixel_size = u32(pixel_size + .5),
+    };
+
+    FcPatternDestroy(match);
+    return file;
+}
+
+auto WritePPM(const Canvas& canvas, const fs::path& path) -> Result<> {
+    std::ofstream f{path, std::ios::binary};
+    if (not f) return Error("Could not open '{}' for writing", path.string());
+    f << std::format("P6\n{} {}\n255\n", canvas.width(), canvas.height());
+    f.write(reinterpret_cast<const char*>(canvas.data().data()), std::streamsize(canvas.data().size()));
+    if (not f) return Error("Could not write '{}'", path.string());
+    return {};
+}
+
+auto WritePNG(const Canvas& canvas, const fs::path& path) -> Result<> {
+    const auto AppendU32 = [](std::string& s, u32 v) {
+        s += char(v >> 24);
+        s += char(v >> 16);
+        s += char(v >> 8);
+        s += char(v);
+    };
+
+    const auto AppendChunk = [&](std::string& s, std::string_view type, std::string_view data) {
+        AppendU32(s, u32(data.size()));
+        auto start = s.size();
+        s += type;
+        s += data;
+        auto crc = crc32(0, reinterpret_cast<const Bytef*>(s.data() + start), uInt(s.size() - start));
+        AppendU32(s, u32(crc));
+    };
+
+    // Every row is prefixed with its filter type, which is always ‘none’.
+    const auto stride = usz(canvas.width()) * 3;
+    std::string raw;
+    raw.reserve((stride + 1) * canvas.height());
+    for (usz y = 0; y < canvas.height(); y++) {
+        raw += '\0';
+        raw.append(reinterpret_cast<const char*>(canvas.data().data() + y * stride), stride);
+    }
+
+    std::string compressed(compressBound(uLong(raw.size())), '\0');
+    auto compressed_size = uLongf(compressed.size());
+    auto err = compress2(
+        reinterpret_cast<Bytef*>(compressed.data()),
+        &compressed_size,
+        reinterpret_cast<const Bytef*>(raw.data()),
+        uLong(raw.size()),
+        Z_BEST_SPEED
+    );
+
+    if (err != Z_OK) return Error("Failed to compress '{}'", path.string());
+    compressed.resize(compressed_size);
+
+    std::string header;
+    AppendU32(header, canvas.width());
+    AppendU32(header, canvas.height());
+    header += "\x08\x02\x00\x00\x00"sv; // 8-bit RGB, no interlacing.
+
+    std::string png{"\x89PNG\r\n\x1a\n"};
+    AppendChunk(png, "IHDR", header);
+    AppendChunk(png, "IDAT", compressed);
+    AppendChunk(png, "IEND", "");
+
+    std::ofstream f{path, std::ios::binary};
+    if (not f) return Error("Could not open '{}' for writing", path.string());
+    f.write(png.data(), std::streamsize(png.size()));
+    if (not f) return Error("Could not write '{}'", path.string());
+    return {};
+}
+
+// ============================================================================
+//  Canvas
+// ============================================================================
+Canvas::Canvas(u32 width, u32 height, u32 colour) : w{width}, h{height}, pixels(usz(width) * height * 3) {
+    for (usz i = 0; i < pixels.size(); i += 3) {
+        pixels[i] = u8(colour >> 16);
+        pixels[i + 1] = u8(colour >> 8);
+        pixels[i + 2] = u8(colour);
+    }
+}
+
+void Canvas::Blend(int x, int y, u8 alpha, u32 colour) {
+    if (x < 0 or y < 0 or u32(x) >= w or u32(y) >= h or alpha == 0) return;
+    auto px = pixels.data() + (usz(y) * w + usz(x)) * 3;
+    const auto Mix = [&](u8& dest, u8 src) { dest = u8((src * alpha + dest * (255 - alpha)) / 255); };
+    Mix(px[0], u8(colour >> 16));
+    Mix(px[1], u8(colour >> 8));
+    Mix(px[2], u8(colour));
+}
+
+void Canvas::FillRect(int x, int y, int width, int height, u32 colour) {
+    for (int yy = y; yy < y + height; yy++)
+        for (int xx = x; xx < x + width; xx++)
+            Blend(xx, yy, 255, colour);
+}
+
+void Canvas::StrokeRect(const XRectangle& r, u32 line_width, u32 colour) {
+    const int lw = int(std::max(line_width, 1u));
+    const int half = lw / 2;
+    const int left = r.x - half;
+    const int top = r.y - half;
+    const int outer_w = r.width + lw;
+    const int outer_h = r.height + lw;
+    FillRect(left, top, outer_w, lw, colour);
+    FillRect(left, top + outer_h - lw, outer_w, lw, colour);
+    FillRect(left, top, lw, outer_h, colour);
+    FillRect(left + outer_w - lw, top, lw, outer_h, colour);
+}
+
+// ============================================================================
+//  Face
+// ============================================================================
+Face::~Face() {
+    if (face) FT_Done_Face(face);
+}
+
+auto Face::Open(FT_Library ft, const FontFile& file) -> Result<std::unique_ptr<Face>> {
+    std::unique_ptr<Face> F{new Face()};
+    if (FT_New_Face(ft, file.path.c_str(), file.index, &F->face) != 0)
+        return Error("Could not open font '{}'", file.path);
+    if (FT_Set_Pixel_Sizes(F->face, 0, file.pixel_size) != 0)
+        return Error("Could not set size {} for font '{}'", file.pixel_size, file.path);
+    return F;
+}
+
+auto Face::descent() const -> int {
+    return int(-face->size->metrics.descender >> 6);
+}
+
+void Face::Draw(Canvas& canvas, std::u32string_view text, int x, int y, u32 colour) {
+    for (auto c : text) {
+        auto& g = Get(c);
+        for (u32 row = 0; row < g.rows; row++)
+            for (u32 col = 0; col < g.width; col++)
+                canvas.Blend(x + g.left + int(col), y - g.top + int(row), g.alpha[row * g.width + col], colour);
+        x += g.advance;
+    }
+}
+
+auto Face::Extents(std::u32string_view text) -> std::pair<int, int> {
+    int x = 0;
+    int left = 0, right = 0, top = 0, bottom = 0;
+    for (auto [i, c] : text | vws::enumerate) {
+        auto& g = Get(c);
+        auto l = x + g.left;
+        auto r = l + int(g.width);
+        auto t = -g.top;
+        auto b = t + int(g.rows);
+        if (i == 0) {
+            left = l;
+            right = r;
+            top = t;
+            bottom = b;
+        } else {
+            left = std::min(left, l);
+            right = std::max(right, r);
+            top = std::min(top, t);
+            bottom = std::max(bottom, b);
+        }
+        x += g.advance;
+    }
+    return {right - left, bottom - top};
+}
+
+auto Face::Get(char32_t c) -> const Glyph& {
+    auto [it, inserted] = glyphs.try_emplace(c);
+    if (not inserted) return it->second;
+
+    // Characters that can’t be rendered are simply left blank.
+    auto& g = it->second;
+    if (FT_Load_Char(face, FT_ULong(c), FT_LOAD_RENDER) != 0) return g;
+
+    auto slot = face->glyph;
+    auto& bm = slot->bitmap;
+    g.left = slot->bitmap_left;
+    g.top = slot->bitmap_top;
+    g.advance = int(slot->advance.x >> 6);
+    g.width = bm.width;
+    g.rows = bm.rows;
+    g.alpha.resize(usz(bm.width) * bm.rows);
+
+    // Embedded bitmaps need not be 8-bit coverage: CJK fonts often have
+    // 1-bit strikes, and colour fonts have BGRA ones, of which we only
+    // draw the coverage. Glyphs in any other format are left blank.
+    for (u32 row = 0; row < bm.rows; row++) {
+        auto src = bm.buffer + isz(row) * bm.pitch;
+        auto dst = g.alpha.data() + usz(row) * bm.width;
+        for (u32 col = 0; col < bm.width; col++) {
+            switch (bm.pixel_mode) {
+                default: break;
+                case FT_PIXEL_MODE_GRAY: dst[col] = src[col]; break;
+                case FT_PIXEL_MODE_MONO: dst[col] = src[col / 8] & (0x80 >> (col % 8)) ? u8(0xFF) : u8(0); break;
+                case FT_PIXEL_MODE_BGRA: dst[col] = src[4 * col + 3]; break;
+            }
+        }
+    }
+    return g;
+}
+
+// ============================================================================
+//  Renderer
+// ============================================================================
+Renderer::~Renderer() {
+    label_face.reset();
+    keycode_face.reset();
+    keysym_face.reset();
+    if (ctx) xkb_context_unref(ctx);
+    if (ft) FT_Done_FreeType(ft);
+}
+
+auto Renderer::Create(const RenderConfig& config) -> Result<std::unique_ptr<Renderer>> {
+    std::unique_ptr<Renderer> R{new Renderer(config)};
+    if (FT_Init_FreeType(&R->ft) != 0) return Error("Failed to initialise FreeType");
+    R->ctx = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (not R->ctx) return Error("Failed to create XKB context");
+    R->label_face = Try(Face::Open(R->ft, config.label_font));
+    R->keycode_face = Try(Face::Open(R->ft, config.keycode_font));
+    R->keysym_face = Try(Face::Open(R->ft, config.keysym_font));
+    return R;
+}
+
+void Renderer::Draw(Canvas& canvas, std::string_view title) {
+    const auto* layout = config.layout;
+    const auto line_width = LineWidth(config.width);
+    PlaceKeys(*layout, config.width, geometry);
+
+    // This mirrors what xkbdisplay draws.
+    for (auto [key, code, label, key_levels] : vws::zip(geometry, layout->codes, layout->labels, levels)) {
+        canvas.StrokeRect(key.border, line_width, FOREGROUND_COLOUR);
+
+        std::u32string label_text{label};
+        auto [w, h] = label_face->Extents(label_text);
+        auto [xpos, ypos] = LabelPosition(key.border, w, h);
+        if (label == U'Q') ypos -= label_face->descent() / 2;
+        label_face->Draw(canvas, label_text, xpos, ypos, GREY_COLOUR);
+
+        auto keycode = KeycodePosition(key.border, xpos, config.font_size);
+        keycode_face->Draw(canvas, text::ToUTF32(std::to_string(code)), keycode.x, keycode.y, GREY_COLOUR);
+
+        for (auto [sym, pos] : vws::zip(key_levels, key.keysyms)) {
+            auto colour = xkb::IsDiacritic(sym) ? RED_COLOUR : FOREGROUND_COLOUR;
+            keysym_face->Draw(canvas, xkb::DisplayText(sym), pos.x, pos.y, colour);
+        }
+    }
+
+    // Instead of the menu text, show the name of the layout.
+    auto title_text = text::ToUTF32(title);
+    auto [w, h] = label_face->Extents(title_text);
+    label_face->Draw(canvas, title_text, int(config.width / 2) - w / 2, h * 2, FOREGROUND_COLOUR);
+}
+
+auto Renderer::LoadKeymap(const fs::path& input) -> Result<xkb_keymap*> {
+    auto file = Try(kb::MappedFile::Open(input.string()));
+    if (input.extension() == ".kb") {
+        auto parsed = Try(kb::ParsedLayout::Parse(file.contents(), input.string()));
+        return kb::CompileKeymap(ctx, parsed, input.stem().string());
+    }
+
+    auto keymap = xkb_keymap_new_from_buffer(
+        ctx,
+        file.contents().data(),
+        file.contents().size(),
+        XKB_KEYMAP_FORMAT_TEXT_V1,
+        XKB_KEYMAP_COMPILE_NO_FLAGS
+    );
+
+    if (not keymap) return Error("Failed to compile keymap '{}'", input.string());
+    return keymap;
+}
+
+auto Renderer::Render(const fs::path& input) -> Result<fs::path> {
+    auto keymap = Try(LoadKeymap(input));
+    xkb::ResolveLevels(keymap, 0, config.layout->codes, levels);
+    xkb_keymap_unref(keymap);
+
+    Canvas canvas{config.width, config.height, BACKGROUND_COLOUR};
+    Draw(canvas, input.stem().string());
+
+    auto output = config.output_dir / input.stem();
+    switch (config.format) {
+        case ImageFormat::PNG:
+            output += ".png";
+            Try(WritePNG(canvas, output));
+            break;
+        case ImageFormat::PPM:
+            output += ".ppm";
+            Try(WritePPM(canvas, output));
+            break;
+    }
+
+    return output;
+}
+
+auto Main(int argc, char** argv) -> Result<int> {
+    using namespace command_line_options;
+    using options = clopts< // clang-format off
+        multiple<positional<"inputs", "The .kb files or XKB keymaps to render">>,
+        option<"-o", "The directory to write the images to">,
+        option<"-f", "The font to use">,
+        option<"-l", "The layout to use", values<LAYOUT_NAME_ISO105, LAYOUT_NAME_ANSI104>>,
+        option<"-w", "The width of the images, in pixels", std::int64_t>,
+        option<"-j", "The number of images to render in parallel", std::int64_t>,
+        option<"--dpi", "The resolution used to convert font sizes to pixels", std::int64_t>,
+        option<"--format", "The image format", values<"png", "ppm">>,
+        help<>
+    >; // clang-format on
+
+    auto opts = options::parse(argc, argv);
+    auto font = opts.get<"-f">("Charis SIL");
+    auto layout_name = opts.get<"-l">(std::getenv("XKBDISPLAY_DEFAULT_LAYOUT") ?: LAYOUT_NAME_ISO105);
+    auto width = opts.get<"-w">(i64(BASE_WIDTH));
+    auto dpi = opts.get<"--dpi">(i64(96));
+    auto jobs = opts.get<"-j">(i64(std::max(std::thread::hardware_concurrency(), 1u)));
+    if (width < BASE_WIDTH / 4) return Error("Width must be at least {}", BASE_WIDTH / 4);
+    if (dpi <= 0) return Error("DPI must be positive");
+    if (jobs <= 0) return Error("Number of jobs must be positive");
+
+    std::vector<fs::path> inputs;
+    for (const auto& input : opts.get<"inputs">()) inputs.emplace_back(input);
+    if (inputs.empty()) return 0;
+
+    // Images are named after their input, so inputs with the same name in
+    // different directories would overwrite each other’s image.
+    std::unordered_map<std::string, const fs::path*> input_by_name;
+    for (const auto& input : inputs) {
+        auto [it, inserted] = input_by_name.try_emplace(input.stem().string(), &input);
+        if (not inserted) return Error(
+            "'{}' and '{}' have the same name, so their images would overwrite each other",
+            it->second->string(),
+            input.string()
+        );
+    }
+
+    RenderConfig config{
+        .layout = FindLayout(layout_name),
+        .width = u32(width),
+        .height = u32(width * BASE_HEIGHT / BASE_WIDTH),
+        .font_size = FontSize(u32(width)),
+        .label_font = {},
+        .keycode_font = {},
+        .keysym_font = {},
+        .output_dir = opts.get<"-o">("."),
+        .format = opts.get<"--format">("png") == "ppm"sv ? ImageFormat::PPM : ImageFormat::PNG,
+    };
+
+    if (not config.layout) return Error("Unknown layout '{}'", layout_name);
+    if (not FcInit()) return Error("Failed to initialise fontconfig");
+    config.label_font = Try(MatchFont(font, config.font_size, u32(dpi)));
+    config.keycode_font = Try(MatchFont(font, KeycodeFontSize(config.font_size), u32(dpi)));
+    config.keysym_font = Try(MatchFont(font, KeysymFontSize(config.font_size), u32(dpi)));
+
+    std::error_code ec;
+    fs::create_directories(config.output_dir, ec);
+    if (ec) return Error("Could not create '{}': {}", config.output_dir.string(), ec.message());
+
+    // Each thread takes the next input until there are none left; the
+    // results are reported in input order once everything is done.
+    std::vector<Result<fs::path>> results(inputs.size());
+    std::atomic<usz> next = 0;
+    auto start = std::chrono::steady_clock::now();
+    {
+        std::vector<std::jthread> workers;
+        for (i64 i = 0; i < std::min(jobs, i64(inputs.size())); i++) {
+            workers.emplace_back([&] {
+                auto renderer = Renderer::Create(config);
+                for (;;) {
+                    auto j = next++;
+                    if (j >= inputs.size()) break;
+                    if (not renderer) results[j] = std::unexpected(renderer.error());
+                    else results[j] = renderer.value()->Render(inputs[j]);
+                }
+            });
+        }
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    usz failed = 0;
+    for (auto [input, res] : vws::zip(inputs, results)) {
+        if (res) continue;
+        std::println(stderr, "{}", res.error());
+        failed++;
+    }
+
+    std::println(
+        stderr,
+        "Rendered {} of {} layouts in {:.2f}s",
+        inputs.size() - failed,
+        inputs.size(),
+        elapsed.count()
+    );
+
+    return failed ? 1 : 0;
+}
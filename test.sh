@@ -2,5 +2,12 @@
 
 set -eu
 
-./xkbgen aegreek.kb "Greek (improved)" > ./generated/aegreek
-./xkbgen ae.kb "English with IPA" > ./generated/ae
+./xkbgen \
+    --job 'aegreek.kb:./generated/aegreek:Greek (improved)' \
+    --job 'ae.kb:./generated/ae:English with IPA'
+
+# Empty groups must still be emitted as a valid list of symbols.
+empty=$(mktemp --suffix .kb)
+trap 'rm -f "$empty"' EXIT
+printf '<AE01> = [ ]\n<AE02> = [] [ a ]\n' > "$empty"
+./xkbgen --verify "$empty" "Empty groups" > /dev/null